@@ -0,0 +1,224 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Version of the compact block encoding announced in sendcmpct */
+static const uint64_t COMPACT_BLOCKS_ENCODING_VERSION = 1;
+
+/** Writes a list of increasing indexes as differences to the previous index plus one */
+template <typename Stream>
+void WriteDifferentialIndexes(Stream& s, const std::vector<uint16_t>& indexes)
+{
+    WriteCompactSize(s, indexes.size());
+    for (size_t i = 0; i < indexes.size(); i++)
+        WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1)));
+}
+
+template <typename Stream>
+void ReadDifferentialIndexes(Stream& s, std::vector<uint16_t>& indexes)
+{
+    uint64_t nCount = ReadCompactSize(s);
+    indexes.clear();
+    uint64_t nOffset = 0;
+    // Grow as the data arrives rather than trusting the count
+    while (indexes.size() < nCount) {
+        nOffset += ReadCompactSize(s);
+        if (nOffset > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("differential index overflowed 16 bits");
+        indexes.push_back(nOffset);
+        nOffset++;
+    }
+}
+
+/** getblocktxn: the transactions of a block a peer could not rebuild from its mempool */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteDifferentialIndexes(s, indexes);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        ReadDifferentialIndexes(s, indexes);
+    }
+};
+
+/** blocktxn: the answer to a getblocktxn, in the order requested */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full inside a compact block, because the receiver cannot have it */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+};
+
+/**
+ * cmpctblock: a block header with a salted 6 byte short ID for each
+ * transaction the receiver likely has in its mempool. The coinbase, and the
+ * coinstake of proof-of-stake blocks, are sent in full, as is the block
+ * signature.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (uint64_t shortid : shorttxids) {
+            uint32_t lsb = shortid & 0xffffffff;
+            uint16_t msb = (shortid >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+        WriteCompactSize(s, prefilledtxn.size());
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            WriteCompactSize(s, prefilledtxn[i].index - (i == 0 ? 0 : (prefilledtxn[i - 1].index + 1)));
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+        ::Serialize(s, vchBlockSig, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        shorttxids.clear();
+        while (shorttxids.size() < nCount) {
+            uint32_t lsb;
+            uint16_t msb;
+            ::Unserialize(s, lsb, nType, nVersion);
+            ::Unserialize(s, msb, nType, nVersion);
+            shorttxids.push_back((uint64_t(msb) << 32) | uint64_t(lsb));
+        }
+        nCount = ReadCompactSize(s);
+        prefilledtxn.clear();
+        uint64_t nOffset = 0;
+        while (prefilledtxn.size() < nCount) {
+            nOffset += ReadCompactSize(s);
+            if (nOffset > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("differential index overflowed 16 bits");
+            prefilledtxn.push_back(PrefilledTransaction());
+            prefilledtxn.back().index = nOffset++;
+            ::Unserialize(s, prefilledtxn.back().tx, nType, nVersion);
+        }
+        ::Unserialize(s, vchBlockSig, nType, nVersion);
+        if (BlockTxCount() > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("indexes overflowed 16 bits");
+        FillShortTxIDSelector();
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //!< Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  //!< Failed to process object, fall back to requesting the full block
+};
+
+/** A block being rebuilt from a compact block, the mempool and the transactions requested for the rest */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vAvailable;
+    size_t prefilled_count, mempool_count, extra_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    explicit PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), extra_count(0), pool(poolIn) {}
+
+    /** Look the short IDs up in the mempool and in vExtraTxn, for instance orphans. Requires cs_main for vExtraTxn. */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<const CTransaction*>& vExtraTxn);
+    bool IsTxAvailable(size_t index) const;
+    /** Build the block with vtx_missing in the place of the unavailable transactions. Can only be called once. */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
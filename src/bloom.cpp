@@ -10,10 +10,13 @@
 #include "chainparams.h"
 #include "hash.h"
 #include "primitives/transaction.h"
+#include "protocol.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
 
+#include <algorithm>
 #include <math.h>
 #include <stdlib.h>
 
@@ -230,3 +233,103 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    double logFPRate = log(nFPRate);
+    // The optimal number of hash functions is log(fp rate) / log(0.5), keep it within the protocol limit
+    nHashFuncs = std::max(1, std::min((int)round(logFPRate / log(0.5)), (int)MAX_HASH_FUNCS));
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    // With up to three generations filled, fp rate = (1 - exp(-k * n / m)) ^ k, solved for the size m in bits
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFPRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) * 2);
+    reset();
+}
+
+uint32_t CRollingBloomFilter::Position(uint64_t nDigest, unsigned int n) const
+{
+    // Double hashing: the halves of one 64 bit digest give all nHashFuncs positions
+    uint32_t h = (uint32_t)nDigest + n * ((uint32_t)(nDigest >> 32) | 1);
+    // Map onto [0, number of positions) without a division
+    return (uint32_t)(((uint64_t)h * (data.size() / 2 * 64)) >> 32);
+}
+
+void CRollingBloomFilter::InsertDigest(uint64_t nDigest)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        // Clear the positions whose two bits name the generation being reused
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        for (size_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (unsigned int n = 0; n < nHashFuncs; n++) {
+        uint32_t pos = Position(nDigest, n);
+        size_t nWord = (pos >> 6) * 2;
+        int bit = pos & 63;
+        data[nWord] = (data[nWord] & ~((uint64_t)1 << bit)) | ((uint64_t)(nGeneration & 1) << bit);
+        data[nWord + 1] = (data[nWord + 1] & ~((uint64_t)1 << bit)) | ((uint64_t)(nGeneration >> 1) << bit);
+    }
+}
+
+bool CRollingBloomFilter::ContainsDigest(uint64_t nDigest) const
+{
+    for (unsigned int n = 0; n < nHashFuncs; n++) {
+        uint32_t pos = Position(nDigest, n);
+        size_t nWord = (pos >> 6) * 2;
+        // A position is set when either generation bit is
+        if (!(((data[nWord] | data[nWord + 1]) >> (pos & 63)) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    InsertDigest(CSipHasher(nKey0, nKey1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    InsertDigest(SipHashUint256(nKey0, nKey1, hash));
+}
+
+void CRollingBloomFilter::insert(const CInv& inv)
+{
+    InsertDigest(SipHashUint256Extra(nKey0, nKey1, inv.hash, inv.type));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return ContainsDigest(CSipHasher(nKey0, nKey1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return ContainsDigest(SipHashUint256(nKey0, nKey1, hash));
+}
+
+bool CRollingBloomFilter::contains(const CInv& inv) const
+{
+    return ContainsDigest(SipHashUint256Extra(nKey0, nKey1, inv.hash, inv.type));
+}
+
+void CRollingBloomFilter::reset()
+{
+    nKey0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nKey1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
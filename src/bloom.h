@@ -11,6 +11,7 @@
 
 #include <vector>
 
+class CInv;
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -104,4 +105,47 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter remembers the most recently inserted elements in a fixed
+ * amount of memory: always the last nElements, and up to 1.5 * nElements,
+ * with a false positive rate of at most nFPRate. It replaces mruset for the
+ * per-peer sets of known inventory and addresses, which cost an allocation
+ * and a tree insert for every element.
+ *
+ * Elements are stored in three generations of nElements / 2. Each position
+ * holds two bits naming the generation that last set it, and starting a new
+ * generation clears the positions of the oldest one. Every element is hashed
+ * once with salted SipHash, the nHashFuncs positions are derived from that.
+ *
+ * Not thread safe, callers lock as they did for mruset.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    void insert(const CInv& inv);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    //! Forget every element and pick a new salt
+    void reset();
+
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    int nGeneration;
+    unsigned int nHashFuncs;
+    uint64_t nKey0, nKey1;
+    //! Position p is bit p % 64 of data[p / 64 * 2] (low generation bit) and data[p / 64 * 2 + 1] (high generation bit)
+    std::vector<uint64_t> data;
+
+    void InsertDigest(uint64_t nDigest);
+    bool ContainsDigest(uint64_t nDigest) const;
+    uint32_t Position(uint64_t nDigest, unsigned int n) const;
+};
+
 #endif // BITCOIN_BLOOM_H
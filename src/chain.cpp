@@ -75,4 +75,54 @@ uint256 CBlockIndex::GetBlockTrust() const
         uint256 bnPoWTrust = ((~uint256(0) >> 20) / (bnTarget + 1));
         return bnPoWTrust > 1 ? bnPoWTrust : 1;
     }
-}
\ No newline at end of file
+}
+
+CBlockHashIndex::CBlockHashIndex(const CChain& chainIn, size_t nSize) : chain(chainIn), vEntries(nSize, std::make_pair(-1, uint256(0))), nTipHeight(-1)
+{
+}
+
+void CBlockHashIndex::SetTip()
+{
+    LOCK(cs);
+
+    int nHeight = chain.Height();
+    if (nHeight < 0)
+        std::fill(vEntries.begin(), vEntries.end(), std::make_pair(-1, uint256(0)));
+
+    int nStart = std::max(0, nHeight - (int)vEntries.size() + 1);
+
+    // after a disconnect part of the window may hold entries overwritten by the old, higher blocks
+    bool fFullScan = nHeight < nTipHeight;
+    nTipHeight = nHeight;
+
+    for (int h = nHeight; h >= nStart; h--) {
+        std::pair<int, uint256>& entry = vEntries[h % vEntries.size()];
+        uint256 hash = chain[h]->GetBlockHash();
+        if (entry.first == h && entry.second == hash) {
+            // entries below are ancestors of a block already in the window
+            if (!fFullScan) break;
+            continue;
+        }
+        entry = std::make_pair(h, hash);
+    }
+}
+
+bool CBlockHashIndex::GetBlockHash(int nHeight, uint256& hash) const
+{
+    LOCK(cs);
+
+    if (nHeight < 0 || nHeight > nTipHeight) return false;
+
+    // Heights older than the window are not answered: reading the chain itself would
+    // need cs_main, which the masternode callers do not hold
+    const std::pair<int, uint256>& entry = vEntries[nHeight % vEntries.size()];
+    if (entry.first != nHeight) return false;
+    hash = entry.second;
+    return true;
+}
+
+int CBlockHashIndex::Height() const
+{
+    LOCK(cs);
+    return nTipHeight;
+}
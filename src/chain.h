@@ -11,6 +11,7 @@
 #include "chainparams.h"
 #include "pow.h"
 #include "primitives/block.h"
+#include "sync.h"
 #include "tinyformat.h"
 #include "uint256.h"
 #include "util.h"
@@ -99,6 +100,8 @@ enum BlockStatus {
     BLOCK_FAILED_VALID = 32, //! stage after last reached validness failed
     BLOCK_FAILED_CHILD = 64, //! descends from failed block
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
+
+    BLOCK_STAKE_PENDING = 128, //! stored ahead of its parent's data, stake checked when connected
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -215,7 +218,7 @@ public:
         SetNull();
     }
 
-    CBlockIndex(const CBlock& block)
+    CBlockIndex(const CBlockHeader& block)
     {
         SetNull();
 
@@ -224,7 +227,10 @@ public:
         nTime = block.nTime;
         nBits = block.nBits;
         nNonce = block.nNonce;
+    }
 
+    CBlockIndex(const CBlock& block) : CBlockIndex(static_cast<const CBlockHeader&>(block))
+    {
         if (block.IsProofOfStake()) {
             SetProofOfStake();
             prevoutStake = block.vtx[1].vin[0].prevout;
@@ -542,4 +548,31 @@ public:
     const CBlockIndex* FindFork(const CBlockIndex* pindex) const;
 };
 
+/** Block hashes of the last nSize blocks of a chain by height, with its own lock so it can be
+ * read without cs_main. SetTip() must be called whenever the tip of the chain changes. */
+class CBlockHashIndex
+{
+private:
+    mutable CCriticalSection cs;
+    const CChain& chain;
+    // ring buffer of (height, hash), position is height % size
+    std::vector<std::pair<int, uint256> > vEntries;
+    int nTipHeight;
+
+public:
+    CBlockHashIndex(const CChain& chainIn, size_t nSize);
+
+    /** Sync with the chain tip, requires cs_main. */
+    void SetTip();
+
+    /**
+     * Return the hash of the block at nHeight, O(1) and consistent with the chain after reorgs.
+     * False for heights older than the window, so it never needs cs_main.
+     */
+    bool GetBlockHash(int nHeight, uint256& hash) const;
+
+    /** Height of the tip the index was last synced to, -1 if empty. */
+    int Height() const;
+};
+
 #endif // BITCOIN_CHAIN_H
@@ -174,7 +174,7 @@ public:
         fMineBlocksOnDemand = false;
         fSkipProofOfWorkCheck = false;
         fTestnetToBeDeprecatedFieldRPC = false;
-        fHeadersFirstSyncingActive = false;
+        fHeadersFirstSyncingActive = true;
 
         nPoolMaxTransactions = 3;
         vSporkKey = ParseHex("0496753303ca6fc00fc57ce3d10fb3e3d9438b3cc15dd2f46c7ccde7073ee97dbb2e268d6bfddad0c2cbe2f0200fa77dc816a12c59aaea4854e8d46f65c8dbfacf");
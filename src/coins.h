@@ -9,6 +9,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -284,6 +285,69 @@ public:
                 return false;
         return true;
     }
+
+    //! Heap memory held by the outputs and their scripts
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        for (const CTxOut& out : vout)
+            ret += memusage::MallocUsage(out.scriptPubKey.capacity());
+        return ret;
+    }
+};
+
+/**
+ * A single unspent output together with the metadata of its transaction, the
+ * way the coin database stores it: one record per outpoint, so spending an
+ * output of a transaction does not rewrite its other outputs.
+ *
+ * Serialized format:
+ * - VARINT(nHeight * 4 + fCoinBase * 2 + fCoinStake)
+ * - VARINT(nVersion)
+ * - the CTxOut (via CTxOutCompressor)
+ */
+class Coin
+{
+public:
+    CTxOut out;
+    bool fCoinBase;
+    bool fCoinStake;
+    int nHeight;
+    int nVersion;
+
+    Coin() : fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
+
+    //! the output nPos of coins, which must be unspent
+    Coin(const CCoins& coins, unsigned int nPos) : out(coins.vout[nPos]), fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake), nHeight(coins.nHeight), nVersion(coins.nVersion)
+    {
+        assert(!out.IsNull());
+    }
+
+    //! add this output to coins at position nPos, taking over the transaction metadata
+    void AddTo(CCoins& coins, unsigned int nPos) const
+    {
+        coins.fCoinBase = fCoinBase;
+        coins.fCoinStake = fCoinStake;
+        coins.nHeight = nHeight;
+        coins.nVersion = nVersion;
+        if (coins.vout.size() <= nPos)
+            coins.vout.resize(nPos + 1);
+        coins.vout[nPos] = out;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned int nCode = nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        nHeight = nCode >> 2;
+        fCoinBase = nCode & 2;
+        fCoinStake = nCode & 1;
+        READWRITE(VARINT(this->nVersion));
+        READWRITE(REF(CTxOutCompressor(REF(out))));
+    }
 };
 
 class CCoinsKeyHasher
@@ -325,10 +389,11 @@ struct CCoinsStats {
     uint64_t nTransactions;
     uint64_t nTransactionOutputs;
     uint64_t nSerializedSize;
-    uint256 hashSerialized;
+    uint256 hashSerialized; //!< only computed by a full scan
+    uint256 hashMuHash;     //!< MuHash of the records of the unspent outputs
     CAmount nTotalAmount;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), hashMuHash(0), nTotalAmount(0) {}
 };
 
 
@@ -347,11 +412,13 @@ public:
     virtual uint256 GetBestBlock() const;
 
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! With fErase the written entries are removed from mapCoins and may be
+    //! moved out of it, otherwise mapCoins is left as it was.
+    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
 
-    //! Calculate statistics about the unspent transaction output set
-    virtual bool GetStats(CCoinsStats& stats) const;
+    //! Calculate statistics about the unspent transaction output set, from
+    //! running totals or, with fFullScan, by reading every unspent output
+    virtual bool GetStats(CCoinsStats& stats, bool fFullScan) const;
 
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
@@ -370,8 +437,9 @@ public:
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView& viewIn);
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
-    bool GetStats(CCoinsStats& stats) const;
+    CCoinsView* GetBackend() const { return base; }
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
+    bool GetStats(CCoinsStats& stats, bool fFullScan) const;
 };
 
 class CCoinsViewCache;
@@ -399,7 +467,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -422,6 +491,9 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage of the CCoins objects in cacheCoins. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -431,7 +503,7 @@ public:
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -447,6 +519,12 @@ public:
      */
     CCoinsModifier ModifyCoins(const uint256& txid);
 
+    /**
+     * Add coins that were read from the base view by another thread, unless there
+     * already is an entry for txid. The base must not have changed since the read.
+     */
+    void PrefetchCoins(const uint256& txid, CCoins& coins);
+
     /**
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
@@ -454,9 +532,26 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, and keep the
+     * entries as clean ones, so that the next blocks still find their inputs in
+     * memory. Spent entries are dropped.
+     */
+    bool Sync();
+
+    /**
+     * Drop clean entries until the cache uses about nTargetUsage bytes, or
+     * only modified entries are left. The oldest coins go first, as new
+     * outputs are the ones most likely spent soon.
+     */
+    void Trim(size_t nTargetUsage);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of nbx coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
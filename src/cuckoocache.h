@@ -0,0 +1,193 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Fixed-size set of elements with cuckoo hashing. Each element can live in
+ * one of eight slots. Inserting into a full neighbourhood displaces an
+ * existing element, which moves to one of its own slots, up to a depth limit
+ * after which the last displaced element is dropped.
+ *
+ * Instead of removing elements, readers mark their slots as collectable,
+ * which only touches an atomic bit; so contains() may run concurrently from
+ * many readers, while insert() needs exclusive access. Elements that nobody
+ * marked age out by generation: once enough of the newest generation is
+ * still live, every older element becomes collectable.
+ */
+namespace CuckooCache
+{
+/** One atomic bit per slot, set when the slot may be overwritten. */
+class bit_packed_atomic_flags
+{
+private:
+    std::unique_ptr<std::atomic<uint8_t>[]> mem;
+
+public:
+    explicit bit_packed_atomic_flags(uint32_t size = 0)
+    {
+        size = (size + 7) / 8;
+        mem.reset(new std::atomic<uint8_t>[size]);
+        for (uint32_t i = 0; i < size; ++i)
+            mem[i].store(0xFF);
+    }
+
+    void bit_set(uint32_t s) { mem[s >> 3].fetch_or(1 << (s & 7), std::memory_order_relaxed); }
+    void bit_unset(uint32_t s) { mem[s >> 3].fetch_and(~(1 << (s & 7)), std::memory_order_relaxed); }
+    bool bit_is_set(uint32_t s) const { return (1 << (s & 7)) & mem[s >> 3].load(std::memory_order_relaxed); }
+
+    void swap(bit_packed_atomic_flags& other) { mem.swap(other.mem); }
+};
+
+/**
+ * Element must be equality comparable and default constructible. Hash
+ * provides uint32_t operator()(const Element&, uint8_t n) const returning
+ * eight independent, uniformly distributed 32 bit hashes for n = 0..7.
+ */
+template <typename Element, typename Hash>
+class cache
+{
+private:
+    std::vector<Element> table;
+    uint32_t size;
+    mutable bit_packed_atomic_flags collection_flags;
+    //! Whether each slot was written during the current generation
+    std::vector<bool> epoch_flags;
+    //! Inserts left before the generation is checked again
+    uint32_t epoch_heuristic_counter;
+    //! Live elements of the current generation that start a new one
+    uint32_t epoch_size;
+    uint8_t depth_limit;
+    const Hash hash_function;
+
+    std::array<uint32_t, 8> compute_hashes(const Element& e) const
+    {
+        std::array<uint32_t, 8> locs;
+        // Map each hash onto [0, size) without a division
+        for (uint8_t n = 0; n < 8; ++n)
+            locs[n] = (uint32_t)(((uint64_t)hash_function(e, n) * (uint64_t)size) >> 32);
+        return locs;
+    }
+
+    static uint32_t invalid() { return ~(uint32_t)0; }
+
+    void allow_erase(uint32_t n) const { collection_flags.bit_set(n); }
+    void please_keep(uint32_t n) const { collection_flags.bit_unset(n); }
+
+    void epoch_check()
+    {
+        if (epoch_heuristic_counter != 0) {
+            --epoch_heuristic_counter;
+            return;
+        }
+        uint32_t epoch_unused_count = 0;
+        for (uint32_t i = 0; i < size; ++i)
+            epoch_unused_count += epoch_flags[i] && !collection_flags.bit_is_set(i);
+        if (epoch_unused_count >= epoch_size) {
+            // Age everything: the current generation becomes old, old elements become collectable
+            for (uint32_t i = 0; i < size; ++i) {
+                if (epoch_flags[i])
+                    epoch_flags[i] = false;
+                else
+                    allow_erase(i);
+            }
+            epoch_heuristic_counter = epoch_size;
+        } else {
+            // Every insert adds at most one live element, so skip the scan until it could matter
+            epoch_heuristic_counter = std::max(1u, std::max(epoch_size / 16, epoch_size - std::min(epoch_size, epoch_unused_count)));
+        }
+    }
+
+public:
+    cache() : size(0), epoch_heuristic_counter(0), epoch_size(0), depth_limit(0), hash_function() {}
+
+    /** Allocate room for about new_size elements, dropping the current ones. Returns the number of slots. */
+    uint32_t setup(uint32_t new_size)
+    {
+        size = std::max<uint32_t>(2, new_size);
+        depth_limit = 1;
+        for (uint32_t n = size; n > 1; n >>= 1)
+            ++depth_limit;
+        std::vector<Element>(size).swap(table);
+        bit_packed_atomic_flags(size).swap(collection_flags);
+        epoch_flags.assign(size, false);
+        // Start a new generation once it holds 45% of the table
+        epoch_size = std::max<uint32_t>(1, (45 * size) / 100);
+        epoch_heuristic_counter = epoch_size;
+        return size;
+    }
+
+    /** Allocate about bytes of memory, see setup(). */
+    uint32_t setup_bytes(size_t bytes)
+    {
+        return setup((uint32_t)std::min<size_t>(bytes / sizeof(Element), invalid() >> 1));
+    }
+
+    /** Add e, possibly evicting another element. Requires exclusive access. */
+    void insert(Element e)
+    {
+        if (size == 0)
+            return;
+        epoch_check();
+        uint32_t last_loc = invalid();
+        bool last_epoch = true;
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        for (uint32_t loc : locs) {
+            if (table[loc] == e) {
+                please_keep(loc);
+                epoch_flags[loc] = last_epoch;
+                return;
+            }
+        }
+        for (uint8_t depth = 0; depth < depth_limit; ++depth) {
+            for (uint32_t loc : locs) {
+                if (!collection_flags.bit_is_set(loc))
+                    continue;
+                table[loc] = std::move(e);
+                please_keep(loc);
+                epoch_flags[loc] = last_epoch;
+                return;
+            }
+            // No free slot: displace the element after the one displaced last, and re-home it
+            last_loc = locs[(1 + (std::find(locs.begin(), locs.end(), last_loc) - locs.begin())) & 7];
+            std::swap(table[last_loc], e);
+            bool epoch = last_epoch;
+            last_epoch = epoch_flags[last_loc];
+            epoch_flags[last_loc] = epoch;
+            locs = compute_hashes(e);
+        }
+    }
+
+    /**
+     * Whether e is in the cache; with erase, also mark it collectable. Safe
+     * to call concurrently with other contains() calls, but not with insert().
+     */
+    bool contains(const Element& e, const bool erase) const
+    {
+        if (size == 0)
+            return false;
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        for (uint32_t loc : locs) {
+            if (table[loc] == e) {
+                if (erase)
+                    allow_erase(loc);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+} // namespace CuckooCache
+
+#endif // BITCOIN_CUCKOOCACHE_H
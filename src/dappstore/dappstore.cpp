@@ -4,10 +4,12 @@
 
 #include "dappstore.h"
 
+#include <atomic>
 #include <map>
 #include <stdexcept>
 
-#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
 #include <string.h>
 #include <univalue.h>
 
@@ -31,37 +33,12 @@ const CScript &GetDAppPubKey() {
     return *dAppPubKey;
 }
 
-DAppStore::DAppStore(const std::string &file) {
-    dbFile = file;
-    DAppStoreDB *db = NULL;
-    try {
-        db = new DAppStoreDB(dbFile, "cr+");
-    } catch (...) {
-        boost::filesystem::remove(GetDataDirForDb() + dbFile);
-        db = new DAppStoreDB(dbFile, "cr+");
-    }
-    if (!db)
-        throw std::runtime_error("Error opening dApp Store file \"" + dbFile + "\"");
-    try {
-        if (!db->Load(dAppTxs, dApps, bestBlock, price))
-            throw std::runtime_error("Error loading dApps list from file \"" + dbFile + "\"");
-    } catch (...) {
-        db->Remove();
-        delete db;
-        bestBlock.SetNull();
-        dApps.clear();
-        dAppTxs.clear();
-        price = 10;
-        db = new DAppStoreDB(dbFile, "cr+");
-        if (!db->Load(dAppTxs, dApps, bestBlock, price)) {
-            delete db;
-            throw std::runtime_error("Error loading dApps list from file \"" + dbFile + "\"");
-        }
-    }
-    delete db;
+DAppStore::DAppStore(size_t nCacheSize, bool fMemory, bool fWipe) : db(nCacheSize, fMemory, fWipe) {
+    if (!db.Load(dAppTxs, dApps, bestBlock, price))
+        throw std::runtime_error("Error loading dApps list from database");
     for (auto dAppTx : dAppTxs) {
         if (!dApps.count(dAppTx))
-            throw std::runtime_error("Error checking dApps list from file \"" + dbFile + "\"");
+            throw std::runtime_error("Error checking dApps list from database");
         AddIsMine(dAppTx, dApps[dAppTx].script);
         for (auto tx : dApps[dAppTx].updateTxs)
             dAppHistoryTxs[tx] = dAppTx;
@@ -74,9 +51,9 @@ bool DAppStore::Add(const uint256 &txid, const DApp &dApp, const CScript &script
     DAppExt tmpDApp = dApp;
     tmpDApp.script = script;
     tmpDApp.created = tmpDApp.time;
-    if (AddTransaction(txid, txid, dApp, &tmpDApp) && DAppStoreDB(dbFile).Add(txid, tmpDApp)) {
+    if (AddTransaction(txid, txid, dApp, &tmpDApp)) {
         bool existing = dApps.count(txid);
-        dApps[txid] = tmpDApp;
+        WriteDApp(txid, tmpDApp, true);
         if (!existing) {
             dAppTxs.push_back(txid);
             AddIsMine(txid, script);
@@ -94,11 +71,8 @@ bool DAppStore::Remove(const uint256 &dAppId, const uint256 &txid, const CScript
     DAppExt tmpDApp = dApps[dAppId];
     tmpDApp.deleted = true;
     tmpDApp.time = time;
-    if (DAppStoreDB(dbFile).Add(dAppId, tmpDApp)) {
-        dApps[dAppId] = tmpDApp;
-        return true;
-    }
-    return false;
+    WriteDApp(dAppId, tmpDApp);
+    return true;
 }
 
 bool DAppStore::Update(const uint256 &dAppId, const uint256 &txid, const CScript &script, const DApp &dApp) {
@@ -108,11 +82,8 @@ bool DAppStore::Update(const uint256 &dAppId, const uint256 &txid, const CScript
         return false;
     DAppExt tmpDApp = dApps[dAppId];
     ApplyUpdate(tmpDApp, dApp);
-    if (DAppStoreDB(dbFile).Add(dAppId, tmpDApp)) {
-        dApps[dAppId] = tmpDApp;
-        return true;
-    }
-    return false;
+    WriteDApp(dAppId, tmpDApp);
+    return true;
 }
 
 bool DAppStore::ApplyUpdate(DAppExt &dApp, const DApp &dAppNew) {
@@ -152,14 +123,14 @@ bool DAppStore::AddTransaction(const uint256 &dAppId, const uint256 &txid, const
     if (dAppHistoryTxs.count(txid))
         return false;
     dAppHistoryTxs[txid] = dAppId;
-    bool ret = true;
     if (dAppExt)
         dAppExt->updateTxs.push_back(txid);
     else {
         dApps[dAppId].updateTxs.push_back(txid);
-        ret = DAppStoreDB(dbFile).Add(dAppId, dApps[dAppId]);
+        WriteDApp(dAppId, dApps[dAppId]);
     }
-    return DAppStoreDB(dbFile).AddHistory(txid, dApp) && ret;
+    db.AddHistory(batch, txid, dApp);
+    return true;
 }
 
 CBlockLocator DAppStore::GetBestBlock() {
@@ -167,7 +138,7 @@ CBlockLocator DAppStore::GetBestBlock() {
 }
 
 bool DAppStore::SetBestBlock(const CBlockLocator &bestBlock) {
-    if (DAppStoreDB(dbFile).WriteBestBlock(bestBlock)) {
+    if (db.WriteBestBlock(bestBlock)) {
         this->bestBlock = bestBlock;
         return true;
     }
@@ -178,6 +149,20 @@ CAmount DAppStore::GetPrice() {
     return price;
 }
 
+// Cheap, stateless part of the ParseVtx checks: a single OP_RETURN output starting a data message
+static bool IsDataMessageCandidate(const CTransaction &tx) {
+    if (!(tx.vout.size() == 1 && tx.vin.size() == 1 && tx.vout[0].nValue == 0 && tx.vout[0].scriptPubKey.size() > 3 && tx.vout[0].scriptPubKey[0] == OP_RETURN))
+        return false;
+    CScript::const_iterator pc = tx.vout[0].scriptPubKey.begin();
+    opcodetype opcode;
+    std::vector<unsigned char> vch;
+    if (!tx.vout[0].scriptPubKey.GetOp(pc, opcode, vch) || opcode != OP_RETURN)
+        return false;
+    if (!tx.vout[0].scriptPubKey.GetOp(pc, opcode, vch) || opcode <= 0 || opcode > OP_PUSHDATA4)
+        return false;
+    return vch.size() >= 3 && vch[0] == DATAMSG_PREFIX && vch[1] == DATAMSG_SUBPREFIX_MAIN;
+}
+
 int DAppStore::ScanForTransactions(CBlockIndex *pindexStart) {
     int ret = 0;
     int64_t nNow = GetTime();
@@ -185,21 +170,54 @@ int DAppStore::ScanForTransactions(CBlockIndex *pindexStart) {
     CBlockIndex *pindex = pindexStart;
     LOCK(cs_main);
 
+    int nThreads = std::max(1, std::min((int) boost::thread::hardware_concurrency(), DAPPSTORE_SCAN_THREADS_MAX));
+
     uiInterface.ShowProgress("Rescanning dApp Store...", 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
     double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
     double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
     while (pindex) {
-        if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+        if (dProgressTip - dProgressStart > 0.0)
             uiInterface.ShowProgress("Rescanning dApp Store... ", std::max(1, std::min(99, (int) ((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-        CBlock block;
-        ReadBlockFromDisk(block, pindex);
-        ret += ParseVtx(block.vtx, block.nTime);
+        // Read a window of blocks in parallel, keeping only candidate data messages
+        std::vector<CBlockIndex*> vWindow;
+        for (; pindex && vWindow.size() < DAPPSTORE_SCAN_WINDOW; pindex = chainActive.Next(pindex))
+            vWindow.push_back(pindex);
+        std::vector<std::vector<CTransaction> > vCandidates(vWindow.size());
+        std::vector<int64_t> vTimes(vWindow.size());
+        std::atomic<size_t> nNext(0);
+        auto reader = [&]() {
+            for (size_t i = nNext++; i < vWindow.size(); i = nNext++) {
+                CBlock block;
+                if (!ReadBlockFromDisk(block, vWindow[i]))
+                    continue;
+                vTimes[i] = block.nTime;
+                for (const CTransaction &tx : block.vtx)
+                    if (IsDataMessageCandidate(tx))
+                        vCandidates[i].push_back(tx);
+            }
+        };
+        boost::thread_group readers;
+        for (int i = 1; i < nThreads; i++)
+            readers.create_thread(reader);
+        reader();
+        readers.join_all();
+
+        // Apply in chain order
+        for (size_t i = 0; i < vWindow.size(); i++)
+            if (!vCandidates[i].empty())
+                ret += ParseVtx(vCandidates[i], vTimes[i]);
+
+        // Checkpoint, so an interrupted rescan resumes after this window
+        SetBestBlock(chainActive.GetLocator(vWindow.back()));
+        if (ShutdownRequested()) {
+            LogPrintf("dApp Store rescan interrupted at block %d\n", vWindow.back()->nHeight);
+            break;
+        }
 
-        pindex = chainActive.Next(pindex);
         if (GetTime() >= nNow + 60) {
             nNow = GetTime();
-            LogPrintf("Still rescanning dApp Store. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+            LogPrintf("Still rescanning dApp Store. At block %d. Progress=%f\n", vWindow.back()->nHeight, Checkpoints::GuessVerificationProgress(vWindow.back()));
         }
     }
     uiInterface.ShowProgress("Rescanning dApp Store...", 100); // hide progress dialog in GUI
@@ -209,7 +227,7 @@ int DAppStore::ScanForTransactions(CBlockIndex *pindexStart) {
 int DAppStore::ParseVtx(std::vector<CTransaction> &vtx, int64_t blockTime) {
     int ret = 0;
     for (const CTransaction &tx : vtx) {
-        if (tx.vout.size() == 1 && tx.vin.size() == 1 && tx.vout[0].nValue == 0 && tx.vout[0].scriptPubKey.size() > 3 && tx.vout[0].scriptPubKey[0] == OP_RETURN) {
+        if (IsDataMessageCandidate(tx)) {
             CTransaction tmpTx = tx;
             GzipInflate gzInflate;
             bool decoded = false;
@@ -341,6 +359,8 @@ int DAppStore::ParseVtx(std::vector<CTransaction> &vtx, int64_t blockTime) {
     }
     if (ret)
         SaveTxs();
+    if (!WriteBatch())
+        LogPrintf("%s : failed to write the dApp Store changes of the block\n", __func__);
     return ret;
 }
 
@@ -349,21 +369,20 @@ int DAppStore::CancelVtx(std::vector <CTransaction> &vtx) {
     for (const CTransaction &tx : vtx) {
         uint256 txid = tx.GetHash();
         if (dApps.count(txid)) {
-            if (DAppStoreDB(dbFile).Delete(txid)) {
-                for (auto updateTx : dApps[txid].updateTxs) {
-                    if (dAppHistoryTxs.count(updateTx))
-                        dAppHistoryTxs.erase(updateTx);
-                    DAppStoreDB(dbFile).DeleteHistory(updateTx);
-                }
-                dApps.erase(txid);
-                auto indexTx = std::find(dAppTxs.begin(), dAppTxs.end(), txid);
-                assert(indexTx != dAppTxs.end());
-                dAppTxs.erase(indexTx);
-                auto indexMyTx = std::find(dAppMyTxs.begin(), dAppMyTxs.end(), txid);
-                if (indexMyTx != dAppMyTxs.end())
-                    dAppMyTxs.erase(indexMyTx);
-                ret++;
+            db.Delete(batch, txid);
+            for (auto updateTx : dApps[txid].updateTxs) {
+                if (dAppHistoryTxs.count(updateTx))
+                    dAppHistoryTxs.erase(updateTx);
+                db.DeleteHistory(batch, updateTx);
             }
+            dApps.erase(txid);
+            auto indexTx = std::find(dAppTxs.begin(), dAppTxs.end(), txid);
+            assert(indexTx != dAppTxs.end());
+            dAppTxs.erase(indexTx);
+            auto indexMyTx = std::find(dAppMyTxs.begin(), dAppMyTxs.end(), txid);
+            if (indexMyTx != dAppMyTxs.end())
+                dAppMyTxs.erase(indexMyTx);
+            ret++;
         } else if (dAppHistoryTxs.count(txid)) {
             uint256 dAppId = dAppHistoryTxs[txid];
             if (dApps.count(dAppId)){
@@ -371,17 +390,25 @@ int DAppStore::CancelVtx(std::vector <CTransaction> &vtx) {
                 assert(indexTx != dApps[dAppId].updateTxs.end());
                 dApps[dAppId].updateTxs.erase(indexTx);
                 RecalculateDApp(dAppId);
-                DAppStoreDB(dbFile).Add(dAppId, dApps[dAppId]);
+                WriteDApp(dAppId, dApps[dAppId], true);
             }
             dAppHistoryTxs.erase(txid);
-            DAppStoreDB(dbFile).DeleteHistory(txid);
+            db.DeleteHistory(batch, txid);
         }
     }
     if (ret)
         SaveTxs();
+    if (!WriteBatch())
+        LogPrintf("%s : failed to write the dApp Store changes of the block\n", __func__);
     return ret;
 }
 
+std::string DAppStore::GetImage(const uint256 &dAppId) {
+    std::string image;
+    db.GetImage(dAppId, image);
+    return image;
+}
+
 bool DAppStore::AddIsMine(const uint256 &txid, const CScript &script) {
     if (!pwalletMain)
         return false;
@@ -397,17 +424,34 @@ void DAppStore::RecalculateDApp(const uint256 &txid) {
     tmpDApp.deleted = false;
     for (auto tx : tmpDApp.updateTxs) {
         DApp txDApp;
-        DAppStoreDB(dbFile).GetHistory(tx, txDApp);
+        db.GetHistory(tx, txDApp);
         ApplyUpdate(tmpDApp, txDApp);
     }
     dApps[txid] = tmpDApp;
 }
 
 bool DAppStore::SaveTxs() {
-    return DAppStoreDB(dbFile).WriteTxs(dAppTxs);
+    db.WriteTxs(batch, dAppTxs);
+    return true;
 }
 
 bool DAppStore::SetPrice(const CAmount &price) {
     this->price = price;
-    return DAppStoreDB(dbFile).WritePrice(price);
+    db.WritePrice(batch, price);
+    return true;
+}
+
+void DAppStore::WriteDApp(const uint256 &dAppId, DAppExt dApp, bool fFullImage) {
+    if (fFullImage || !dApp.image.empty())
+        db.Add(batch, dAppId, dApp);
+    else
+        db.WriteRecord(batch, dAppId, dApp);
+    dApp.image.clear();
+    dApps[dAppId] = dApp;
+}
+
+bool DAppStore::WriteBatch() {
+    bool ret = db.WriteBatch(batch);
+    batch.Clear();
+    return ret;
 }
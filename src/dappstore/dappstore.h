@@ -8,6 +8,9 @@
 #define DAPPSTORE_COMISSION_ADD 10
 #define DAPPSTORE_COMISSION_UPDATE 1
 #define DATAMSG_MIN_LENGTH 78
+#define DAPPSTORE_DB_CACHE (2 << 20)
+#define DAPPSTORE_SCAN_WINDOW 256
+#define DAPPSTORE_SCAN_THREADS_MAX 8
 
 #include <unordered_map>
 #include <string>
@@ -24,7 +27,7 @@
 
 class DAppStore {
 public:
-    DAppStore(const std::string &file);
+    DAppStore(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     CBlockLocator GetBestBlock();
 
@@ -38,6 +41,9 @@ public:
 
     int CancelVtx(std::vector <CTransaction> &vtx);
 
+    // Images are not kept in dApps, read them from the database
+    std::string GetImage(const uint256 &dAppId);
+
     std::unordered_map <uint256, DAppExt> dApps;
     std::vector <uint256> dAppTxs;
     std::vector <uint256> dAppMyTxs;
@@ -63,7 +69,15 @@ protected:
 
     bool SetPrice(const CAmount &price);
 
-    std::string dbFile;
+    // fFullImage: dApp.image is the whole current image, so an empty one is erased.
+    // Otherwise the in-memory record has no image and only a new one is written.
+    void WriteDApp(const uint256 &dAppId, DAppExt dApp, bool fFullImage = false);
+
+    bool WriteBatch();
+
+    DAppStoreDB db;
+    // writes of the block being parsed or cancelled
+    CLevelDBBatch batch;
     CBlockLocator bestBlock;
     CAmount price = 10;
 
@@ -4,78 +4,96 @@
 
 #include "dappstoredb.h"
 
+#include <boost/scoped_ptr.hpp>
+
 #include "dapp.h"
+#include "util.h"
+
+static const char DB_DAPP = 'd';
+static const char DB_IMAGE = 'i';
+static const char DB_HISTORY = 'h';
+static const char DB_BEST_BLOCK = 'B';
+static const char DB_TXS = 'T';
+static const char DB_PRICE = 'P';
+
+DAppStoreDB::DAppStoreDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDirForDb() + "dappstore", nCacheSize, fMemory, fWipe) {}
+
+void DAppStoreDB::Add(CLevelDBBatch &batch, const uint256 &txid, const DAppExt &dApp) {
+    if (dApp.image.empty())
+        batch.Erase(std::make_pair(DB_IMAGE, txid));
+    else
+        batch.Write(std::make_pair(DB_IMAGE, txid), dApp.image);
+    WriteRecord(batch, txid, dApp);
+}
 
-bool DAppStoreDB::Add(const uint256 &txid, const DAppExt &dApp) {
-    return Write(txid, dApp);
+void DAppStoreDB::WriteRecord(CLevelDBBatch &batch, const uint256 &txid, const DAppExt &dApp) {
+    DAppExt record = dApp;
+    record.image.clear();
+    batch.Write(std::make_pair(DB_DAPP, txid), record);
 }
 
-bool DAppStoreDB::AddHistory(const uint256 &txid, const DApp &dApp) {
-    return Write(std::make_pair(std::string("tx"), txid), dApp);
+void DAppStoreDB::AddHistory(CLevelDBBatch &batch, const uint256 &txid, const DApp &dApp) {
+    batch.Write(std::make_pair(DB_HISTORY, txid), dApp);
 }
 
 bool DAppStoreDB::GetHistory(const uint256 &txid, DApp &dApp) {
-    return Read(std::make_pair(std::string("tx"), txid), dApp);
+    return Read(std::make_pair(DB_HISTORY, txid), dApp);
 }
 
-bool DAppStoreDB::DeleteHistory(const uint256 &txid) {
-    return Erase(std::make_pair(std::string("tx"), txid));
+bool DAppStoreDB::GetImage(const uint256 &txid, std::string &image) {
+    return Read(std::make_pair(DB_IMAGE, txid), image);
 }
 
-bool DAppStoreDB::Delete(const uint256 &txid) {
-    return Erase(txid);
+void DAppStoreDB::DeleteHistory(CLevelDBBatch &batch, const uint256 &txid) {
+    batch.Erase(std::make_pair(DB_HISTORY, txid));
 }
 
-bool DAppStoreDB::Remove() {
-    return bitdb.RemoveDb(strFile);
+void DAppStoreDB::Delete(CLevelDBBatch &batch, const uint256 &txid) {
+    batch.Erase(std::make_pair(DB_DAPP, txid));
+    batch.Erase(std::make_pair(DB_IMAGE, txid));
 }
 
 bool DAppStoreDB::Load(std::vector<uint256> &dAppTxs, std::unordered_map <uint256, DAppExt> &dApps, CBlockLocator &bestBlock, CAmount &price) {
-    Dbc *pcursor = GetCursor();
-    if (!pcursor)
-        return false;
-    bool fError = false;
-    while (true) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-        if (ret == DB_NOTFOUND)
-            break;
-        if (ret) {
-            fError = true;
-            break;
-        }
-        if (ssKey.size() == sizeof(uint256)) {
+    Read(DB_BEST_BLOCK, bestBlock);
+    Read(DB_TXS, dAppTxs);
+    Read(DB_PRICE, price);
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair(DB_DAPP, uint256(0));
+    pcursor->Seek(ssKeySet.str());
+
+    // Only the dApp records, images and history stay on disk until needed
+    while (pcursor->Valid()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != DB_DAPP)
+                break;
             uint256 txid;
             ssKey >> txid;
-            DAppExt dApp;
-            ssValue >> dApp;
-            dApps[txid] = dApp;
-        } else if (ssKey.size() == sizeof(uint256) + 3) { // skip "tx" + uint256
-        } else {
-            std::string key;
-            ssKey >> key;
-            if (key == "bestblock") {
-                ssValue >> bestBlock;
-            } else if (key == "txs") {
-                ssValue >> dAppTxs;
-            } else if (key == "price") {
-                ssValue >> price;
-            }
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> dApps[txid];
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    pcursor->close();
-    return !fError;
+    return true;
 }
 
 bool DAppStoreDB::WriteBestBlock(const CBlockLocator& bestBlock) {
-    return Write(std::string("bestblock"), bestBlock);
+    return Write(DB_BEST_BLOCK, bestBlock);
 }
 
-bool DAppStoreDB::WriteTxs(const std::vector <uint256> &dAppTxs) {
-    return Write(std::string("txs"), dAppTxs);
+void DAppStoreDB::WriteTxs(CLevelDBBatch &batch, const std::vector <uint256> &dAppTxs) {
+    batch.Write(DB_TXS, dAppTxs);
 }
 
-bool DAppStoreDB::WritePrice(const CAmount &price) {
-    return Write(std::string("price"), price);
-}
\ No newline at end of file
+void DAppStoreDB::WritePrice(CLevelDBBatch &batch, const CAmount &price) {
+    batch.Write(DB_PRICE, price);
+}
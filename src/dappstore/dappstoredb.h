@@ -8,33 +8,46 @@
 #include <unordered_map>
 
 #include "dapp.h"
+#include "leveldbwrapper.h"
 #include "uint256.h"
-#include "wallet/db.h"
 #include "primitives/block.h"
 
-class DAppStoreDB : public CDB {
+/**
+ * dApp Store database. dApp records are kept without their image, which is
+ * stored under its own key and only read on request.
+ */
+class DAppStoreDB : public CLevelDBWrapper {
 public:
-    DAppStoreDB(const std::string &strFilename, const char *pszMode = "r+") : CDB(strFilename, pszMode) {}
+    DAppStoreDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool Add(const uint256 &txid, const DAppExt &dApp);
+private:
+    DAppStoreDB(const DAppStoreDB&);
+    void operator=(const DAppStoreDB&);
 
-    bool AddHistory(const uint256 &txid, const DApp &dApp);
+public:
+    /** Write the record and its image, erasing the stored image if dApp has none */
+    void Add(CLevelDBBatch &batch, const uint256 &txid, const DAppExt &dApp);
+
+    /** Write the record only, leaving the stored image as it is */
+    void WriteRecord(CLevelDBBatch &batch, const uint256 &txid, const DAppExt &dApp);
+
+    void AddHistory(CLevelDBBatch &batch, const uint256 &txid, const DApp &dApp);
 
     bool GetHistory(const uint256 &txid, DApp &dApp);
 
-    bool DeleteHistory(const uint256 &txid);
+    bool GetImage(const uint256 &txid, std::string &image);
 
-    bool Delete(const uint256 &txid);
+    void DeleteHistory(CLevelDBBatch &batch, const uint256 &txid);
 
-    bool Remove();
+    void Delete(CLevelDBBatch &batch, const uint256 &txid);
 
     bool Load(std::vector <uint256> &dAppTxs, std::unordered_map <uint256, DAppExt> &dApps, CBlockLocator &bestBlock, CAmount &price);
 
     bool WriteBestBlock(const CBlockLocator &bestBlock);
 
-    bool WriteTxs(const std::vector <uint256> &dAppTxs);
+    void WriteTxs(CLevelDBBatch &batch, const std::vector <uint256> &dAppTxs);
 
-    bool WritePrice(const CAmount &price);
+    void WritePrice(CLevelDBBatch &batch, const CAmount &price);
 };
 
 #endif // BITCOIN_DAPPSTOREDB_H
@@ -311,6 +311,30 @@ uint256 SerializeHash(const T& obj, int nType = SER_GETHASH, int nVersion = PROT
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4, a fast keyed hash for short inputs. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    //! Construct a SipHash calculator initialized with 128-bit key (k0, k1)
+    CSipHasher(uint64_t k0, uint64_t k1);
+    //! Hash a 64-bit integer worth of data, only allowed while the byte count is a multiple of 8
+    CSipHasher& Write(uint64_t data);
+    //! Hash arbitrary bytes
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    //! Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched.
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a 256-bit value, faster than writing it to a CSipHasher. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+/** SipHash-2-4 of a 256-bit value followed by 4 more bytes. */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+
 void BIP32Hash(const ChainCode chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
@@ -4,9 +4,13 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "db.h"
+#include "init.h"
 #include "kernel.h"
 #include "masternode-sync.h"
 #include "script/interpreter.h"
@@ -15,6 +19,8 @@
 #include "stakeinput.h"
 #include "utilmoneystr.h"
 
+int nStakeSearchThreads = DEFAULT_STAKE_SEARCH_THREADS;
+
 // v1 modifier interval.
 static const int64_t OLD_MODIFIER_INTERVAL = 2087;
 
@@ -220,6 +226,114 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+CStakeModifierIndex stakeModifierIndex;
+
+void CStakeModifierIndex::Reset()
+{
+    pindexTip = NULL;
+    vModifierBlock.clear();
+    mapPending.clear();
+    mapUndo.clear();
+}
+
+void CStakeModifierIndex::Connect(const CBlockIndex* pindex)
+{
+    const int nHeight = pindex->nHeight;
+
+    // Kernels from the v2 switchover on hash with the v2 modifier. A pending height could
+    // only be resolved by such a block, so nothing is indexed past it.
+    if (Params().IsStakeModifierV2(nHeight)) {
+        mapPending.clear();
+        mapUndo.clear();
+        pindexTip = pindex;
+        return;
+    }
+
+    assert(nHeight == (int)vModifierBlock.size());
+    vModifierBlock.push_back(NULL);
+
+    std::vector<int>& vResolved = mapUndo[nHeight];
+    if (pindex->GeneratedStakeModifier()) {
+        std::multimap<int64_t, int>::iterator itEnd = mapPending.upper_bound(pindex->GetBlockTime());
+        for (std::multimap<int64_t, int>::iterator it = mapPending.begin(); it != itEnd; ++it) {
+            vModifierBlock[it->second] = pindex;
+            vResolved.push_back(it->second);
+        }
+        mapPending.erase(mapPending.begin(), itEnd);
+    }
+    mapPending.insert(std::make_pair(pindex->GetBlockTime() + OLD_MODIFIER_INTERVAL, nHeight));
+
+    while (!mapUndo.empty() && mapUndo.begin()->first <= nHeight - STAKE_MODIFIER_INDEX_UNDO_DEPTH)
+        mapUndo.erase(mapUndo.begin());
+    pindexTip = pindex;
+}
+
+bool CStakeModifierIndex::Disconnect()
+{
+    const int nHeight = pindexTip->nHeight;
+    if (Params().IsStakeModifierV2(nHeight)) {
+        // the switchover block dropped the pending heights, going back past it starts over
+        if (!Params().IsStakeModifierV2(nHeight - 1))
+            return false;
+        pindexTip = pindexTip->pprev;
+        return true;
+    }
+
+    std::map<int, std::vector<int> >::iterator itUndo = mapUndo.find(nHeight);
+    if (itUndo == mapUndo.end())
+        return false;
+
+    // the tip itself can only be pending
+    std::pair<std::multimap<int64_t, int>::iterator, std::multimap<int64_t, int>::iterator> range =
+        mapPending.equal_range(pindexTip->GetBlockTime() + OLD_MODIFIER_INTERVAL);
+    for (std::multimap<int64_t, int>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == nHeight) {
+            mapPending.erase(it);
+            break;
+        }
+    }
+    for (int nResolved : itUndo->second) {
+        vModifierBlock[nResolved] = NULL;
+        mapPending.insert(std::make_pair(pindexTip->GetAncestor(nResolved)->GetBlockTime() + OLD_MODIFIER_INTERVAL, nResolved));
+    }
+    mapUndo.erase(itUndo);
+    vModifierBlock.pop_back();
+    pindexTip = pindexTip->pprev;
+    return true;
+}
+
+void CStakeModifierIndex::SetTip(const CBlockIndex* pindexNew)
+{
+    LOCK(cs);
+    if (!pindexNew) {
+        Reset();
+        return;
+    }
+
+    // Roll back to the fork point, or start over if it is deeper than the undo data
+    while (pindexTip && pindexNew->GetAncestor(pindexTip->nHeight) != pindexTip) {
+        if (!Disconnect()) {
+            LogPrint("staking", "%s : rebuilding stake modifier index from genesis\n", __func__);
+            Reset();
+        }
+    }
+
+    std::vector<const CBlockIndex*> vConnect;
+    for (const CBlockIndex* pindex = pindexNew; pindex != pindexTip; pindex = pindex->pprev)
+        vConnect.push_back(pindex);
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = vConnect.rbegin(); it != vConnect.rend(); ++it)
+        Connect(*it);
+}
+
+bool CStakeModifierIndex::GetModifierBlock(const CBlockIndex* pindexFrom, const CBlockIndex*& pindexModifier) const
+{
+    LOCK(cs);
+    if (!pindexTip || pindexFrom->nHeight >= (int)vModifierBlock.size() || pindexTip->GetAncestor(pindexFrom->nHeight) != pindexFrom)
+        return false;
+    pindexModifier = vModifierBlock[pindexFrom->nHeight];
+    return pindexModifier != NULL;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
@@ -235,7 +349,17 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
         nStakeModifier = pindexFrom->nStakeModifier;
         return true;
     }
-    const CBlockIndex* pindex = pindexFrom;
+
+    // Indexed when the active chain reaches far enough past the origin block
+    const CBlockIndex* pindex = NULL;
+    if (stakeModifierIndex.GetModifierBlock(pindexFrom, pindex)) {
+        nStakeModifierHeight = pindex->nHeight;
+        nStakeModifierTime = pindex->GetBlockTime();
+        nStakeModifier = pindex->nStakeModifier;
+        return true;
+    }
+
+    pindex = pindexFrom;
     CBlockIndex* pindexNext = chainActive[pindex->nHeight + 1];;
 
     // loop to find the stake modifier later by a selection interval
@@ -323,9 +447,9 @@ bool GetHashProofOfStake(const CBlockIndex* pindexPrev, CStakeInput* stake, cons
     return true;
 }
 
-bool Stake(const CBlockIndex* pindexPrev, CStakeInput* stakeInput, unsigned int nBits, unsigned int& nTimeTx, uint256& hashProofOfStake)
+bool CStakeKernel::SetInput(const CBlockIndex* pindexPrev, CStakeInput* stakeInputIn, unsigned int nBits, unsigned int nTimeTx)
 {
-    int prevHeight = pindexPrev->nHeight;
+    stakeInput = stakeInputIn;
 
     // get stake input pindex
     CBlockIndex* pindexFrom = stakeInput->GetIndexFrom();
@@ -335,39 +459,120 @@ bool Stake(const CBlockIndex* pindexPrev, CStakeInput* stakeInput, unsigned int
     const int nHeightBlockFrom = pindexFrom->nHeight;
 
     // check for maturity (min age/depth) requirements
-    if (!Params().HasStakeMinAgeOrDepth(prevHeight + 1, nTimeTx, nHeightBlockFrom, nTimeBlockFrom))
+    if (!Params().HasStakeMinAgeOrDepth(pindexPrev->nHeight + 1, nTimeTx, nHeightBlockFrom, nTimeBlockFrom))
         return error("%s : min age violation - height=%d - nTimeTx=%d, nTimeBlockFrom=%d, nHeightBlockFrom=%d",
-                         __func__, prevHeight + 1, nTimeTx, nTimeBlockFrom, nHeightBlockFrom);
+                         __func__, pindexPrev->nHeight + 1, nTimeTx, nTimeBlockFrom, nHeightBlockFrom);
 
-    // iterate the hashing
-    bool fSuccess = false;
-    const unsigned int nHashDrift = 60;
-    unsigned int nTryTime = nTimeTx - 1;
-    // iterate from nTimeTx up to nTimeTx + nHashDrift
-    // but not after the max allowed future blocktime drift (3 minutes for PoS)
-    const unsigned int maxTime = std::min(nTimeTx + nHashDrift, Params().MaxFutureBlockTime(GetAdjustedTime(), true));
+    CDataStream modifier_ss(SER_GETHASH, 0);
+    if (!Params().IsStakeModifierV2(pindexPrev->nHeight + 1)) {
+        uint64_t nStakeModifier = 0;
+        if (!stakeInput->GetModifier(nStakeModifier))
+            return error("%s : Failed to get kernel stake modifier", __func__);
+        modifier_ss << nStakeModifier;
+    } else {
+        modifier_ss << pindexPrev->nStakeModifierV2;
+    }
 
-    while (nTryTime < maxTime)
-    {
-        //new block came in, move on
-        if (chainActive.Height() != prevHeight)
-            break;
+    // Weighted target
+    uint256 bnTargetIn;
+    bnTargetIn.SetCompact(nBits);
+    bnTargetIn *= uint256(stakeInput->GetValue()) / 100;
+
+    SetPrefix(modifier_ss, nTimeBlockFrom, stakeInput->GetUniqueness(), bnTargetIn);
+    return true;
+}
 
-        ++nTryTime;
+void CStakeKernel::SetPrefix(const CDataStream& ssModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, const uint256& bnTargetIn)
+{
+    // Same layout as GetHashProofOfStake, minus the trailing nTimeTx
+    ssPrefix = CHashWriter(SER_GETHASH, 0);
+    ssPrefix << ssModifier << nTimeBlockFrom << ssUniqueID;
+    bnTarget = bnTargetIn;
+}
 
-        // if stake hash does not meet the target then continue to next iteration
-        if (!CheckStakeKernelHash(pindexPrev, nBits, stakeInput, nTryTime, hashProofOfStake))
-            continue;
+int SearchStakeKernels(std::vector<CStakeKernel>& vKernels, size_t nStart, unsigned int nTimeFrom, unsigned int nTimeTo,
+    int nThreads, const std::function<bool()>& fnInterrupt, uint64_t* pnHashes)
+{
+    std::atomic<size_t> nNext(nStart);
+    std::atomic<size_t> nFound(vKernels.size());
+    std::atomic<bool> fInterrupted(false);
+    std::atomic<uint64_t> nHashes(0);
+
+    // Workers claim inputs in order and give up on anything past the lowest hit,
+    // so the result is the same input a serial sweep would have picked.
+    auto worker = [&]() {
+        uint64_t nWorkerHashes = 0;
+        for (size_t i = nNext++; i < nFound.load() && !fInterrupted.load(); i = nNext++) {
+            if (fnInterrupt && fnInterrupt()) {
+                fInterrupted = true;
+                break;
+            }
+            CStakeKernel& kernel = vKernels[i];
+            for (int64_t nTryTime = nTimeFrom; nTryTime <= nTimeTo && i < nFound.load(); ++nTryTime) {
+                ++nWorkerHashes;
+                if (!kernel.CheckHash(nTryTime, kernel.hashProofOfStake))
+                    continue;
+                kernel.nTimeTx = nTryTime;
+                size_t nPrev = nFound.load();
+                while (i < nPrev && !nFound.compare_exchange_weak(nPrev, i)) {}
+                break;
+            }
+        }
+        nHashes += nWorkerHashes;
+    };
+
+    size_t nRemaining = nStart < vKernels.size() ? vKernels.size() - nStart : 0;
+    nThreads = std::max(1, std::min<int>(nThreads, nRemaining));
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(worker);
+    worker();
+    threadGroup.join_all();
+
+    if (pnHashes)
+        *pnHashes = nHashes.load();
+    if (fInterrupted || nFound.load() >= vKernels.size())
+        return -1;
+    return nFound.load();
+}
+
+int FindStakeKernel(const CBlockIndex* pindexPrev, std::vector<CStakeKernel>& vKernels, size_t nStart, unsigned int nTimeTx)
+{
+    const int prevHeight = pindexPrev->nHeight;
 
-        // if we made it this far, then we have successfully found a valid kernel hash
-        fSuccess = true;
-        nTimeTx = nTryTime;
-        break;
+    // iterate from nTimeTx up to nTimeTx + nHashDrift
+    // but not after the max allowed future blocktime drift (3 minutes for PoS)
+    const unsigned int nHashDrift = 60;
+    const unsigned int maxTime = std::min(nTimeTx + nHashDrift, Params().MaxFutureBlockTime(GetAdjustedTime(), true));
+
+    int nThreads = nStakeSearchThreads;
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_STAKE_SEARCH_THREADS));
+
+    uint64_t nHashes = 0;
+    int64_t nTimeStart = GetTimeMicros();
+    //new block came in, move on
+    int nKernel = SearchStakeKernels(vKernels, nStart, nTimeTx, maxTime, nThreads,
+        [prevHeight]() { return chainActive.Height() != prevHeight || ShutdownRequested(); }, &nHashes);
+    int64_t nTimeElapsed = GetTimeMicros() - nTimeStart;
+
+    LogPrint("staking", "%s : %u hashes over %u inputs on %d threads in %.2fms\n", __func__,
+        nHashes, vKernels.size() - nStart, nThreads, nTimeElapsed * 0.001);
+    if (nKernel >= 0) {
+        const CStakeKernel& kernel = vKernels[nKernel];
+        LogPrint("staking", "%s : Proof Of Stake:"
+                            "\nssUniqueID=%s"
+                            "\nnTimeTx=%d"
+                            "\nhashProofOfStake=%s"
+                            "\nweight=%d\n\n",
+            __func__, HexStr(kernel.stakeInput->GetUniqueness()), kernel.nTimeTx, kernel.hashProofOfStake.GetHex(),
+            kernel.stakeInput->GetValue());
     }
 
     mapHashedBlocks.clear();
     mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
-    return fSuccess;
+    return nKernel;
 }
 
 bool initStakeInput(const CBlock block, std::unique_ptr<CStakeInput>& stake, int nPreviousBlockHeight) {
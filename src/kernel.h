@@ -7,9 +7,12 @@
 #ifndef BITCOIN_KERNEL_H
 #define BITCOIN_KERNEL_H
 
+#include "hash.h"
 #include "main.h"
 #include "stakeinput.h"
 
+#include <functional>
+
 
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 static const unsigned int MODIFIER_INTERVAL = 60;
@@ -18,11 +21,103 @@ static const unsigned int MODIFIER_INTERVAL = 60;
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+/** Maximum number of kernel search threads */
+static const int MAX_STAKE_SEARCH_THREADS = 16;
+/** -stakethreads default (number of kernel search threads, 0 = auto) */
+static const int DEFAULT_STAKE_SEARCH_THREADS = 0;
+
+extern int nStakeSearchThreads;
+
+/**
+ * A stake input prepared for the kernel search. Everything that does not
+ * depend on the candidate timestamp (stake modifier, origin block time,
+ * uniqueness and weighted target) is hashed once, so each try only adds
+ * nTimeTx to a copy of the prefix.
+ */
+class CStakeKernel
+{
+private:
+    CHashWriter ssPrefix;
+    uint256 bnTarget;
+
+public:
+    CStakeInput* stakeInput;
+
+    // Set by the search when this input meets the target
+    unsigned int nTimeTx;
+    uint256 hashProofOfStake;
+
+    CStakeKernel() : ssPrefix(SER_GETHASH, 0), bnTarget(0), stakeInput(NULL), nTimeTx(0), hashProofOfStake(0) {}
+
+    bool SetInput(const CBlockIndex* pindexPrev, CStakeInput* stakeInputIn, unsigned int nBits, unsigned int nTimeTx);
+    void SetPrefix(const CDataStream& ssModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, const uint256& bnTargetIn);
+
+    uint256 GetHash(unsigned int nTimeTx) const
+    {
+        CHashWriter ss(ssPrefix);
+        ss << nTimeTx;
+        return ss.GetHash();
+    }
+
+    bool CheckHash(unsigned int nTimeTx, uint256& hashRet) const
+    {
+        hashRet = GetHash(nTimeTx);
+        return hashRet < bnTarget;
+    }
+};
+
+/** Blocks kept per height to undo modifier resolutions on disconnect */
+static const int STAKE_MODIFIER_INDEX_UNDO_DEPTH = 1000;
+
+/**
+ * For each height of the active chain, the block whose v1 stake modifier applies to
+ * kernels from that height: the first later block generating a modifier at least a
+ * selection interval after it. Built incrementally as the tip moves, so
+ * GetKernelStakeModifier no longer walks the chain forward for every stake.
+ * Heights from the v2 modifier switchover on are not indexed.
+ */
+class CStakeModifierIndex
+{
+private:
+    mutable CCriticalSection cs;
+    const CBlockIndex* pindexTip;
+    // modifier block by height, NULL until a later block resolves it
+    std::vector<const CBlockIndex*> vModifierBlock;
+    // unresolved heights by the block time a modifier must reach
+    std::multimap<int64_t, int> mapPending;
+    // heights resolved by each recent block, to undo a disconnect
+    std::map<int, std::vector<int> > mapUndo;
+
+    void Connect(const CBlockIndex* pindex);
+    bool Disconnect();
+    void Reset();
+
+public:
+    CStakeModifierIndex() : pindexTip(NULL) {}
+
+    /** Sync with a new active chain tip, requires cs_main. */
+    void SetTip(const CBlockIndex* pindexNew);
+
+    /** Modifier block for a stake from pindexFrom, false if unknown or not resolved yet. */
+    bool GetModifierBlock(const CBlockIndex* pindexFrom, const CBlockIndex*& pindexModifier) const;
+};
+
+extern CStakeModifierIndex stakeModifierIndex;
+
 // Compute the hash modifier for proof-of-stake
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kernel);
-bool Stake(const CBlockIndex* pindexPrev, CStakeInput* stakeInput, unsigned int nBits, unsigned int& nTimeTx, uint256& hashProofOfStake);
+
+/**
+ * Sweep [nTimeFrom, nTimeTo] for every kernel in vKernels[nStart..] on up to nThreads threads.
+ * Returns the index of the first kernel (in vector order) meeting its target, or -1 if none
+ * does or fnInterrupt fired. Inputs after an already found kernel are skipped.
+ */
+int SearchStakeKernels(std::vector<CStakeKernel>& vKernels, size_t nStart, unsigned int nTimeFrom, unsigned int nTimeTo,
+    int nThreads, const std::function<bool()>& fnInterrupt, uint64_t* pnHashes = NULL);
+// Search the wallet's prepared stake inputs for a kernel on top of pindexPrev
+int FindStakeKernel(const CBlockIndex* pindexPrev, std::vector<CStakeKernel>& vKernels, size_t nStart, unsigned int nTimeTx);
 
 // Initialize the stake input object
 bool initStakeInput(const CBlock block, std::unique_ptr<CStakeInput>& stake, int nPreviousBlockHeight);
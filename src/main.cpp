@@ -10,10 +10,13 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "dappstore/dappstore.h"
 #include "init.h"
 #include "kernel.h"
@@ -60,6 +63,7 @@ BlockMap mapBlockIndex;
 std::map<uint256, uint256> mapProofOfStake;
 std::map<unsigned int, unsigned int> mapHashedBlocks;
 CChain chainActive;
+CBlockHashIndex chainActiveHashes(chainActive, BLOCK_HASH_INDEX_SIZE);
 CBlockIndex* pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
@@ -71,7 +75,7 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 bool fPreventBestBlockSaving = false;
 
@@ -98,9 +102,38 @@ std::map<uint256, COrphanTx> mapOrphanTransactions;
 std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
 std::map<uint256, int64_t> mapRejectedBlocks;
 
+/**
+ * Transactions AcceptToMemoryPool rejected since the tip last changed, so that their invs
+ * from other peers are not fetched again. A new tip may make them valid, so the filter is
+ * reset then. Requires cs_main.
+ */
+static CRollingBloomFilter& RecentRejects()
+{
+    static CRollingBloomFilter recentRejects(120000, 0.000001);
+    static uint256 hashRecentRejectsChainTip;
+    if (chainActive.Tip() && chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip) {
+        hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
+        recentRejects.reset();
+    }
+    return recentRejects;
+}
+
+/** Outpoints spent by recently accepted blocks, so PoS fork checks don't reread forks from disk. */
+typedef std::map<const CBlockIndex*, std::set<COutPoint> > BlockSpendsMap;
+BlockSpendsMap mapRecentBlockSpends;
+
 void EraseOrphansFor(NodeId peer);
 
 static void CheckBlockIndex();
+static bool CheckPendingStake(const CBlock& block, CValidationState& state, CBlockIndex* pindex);
+static void CheckPendingStakeChildren(CBlockIndex* pindexReady);
+static bool CheckPoSHeaderBudget(const CBlockHeader& header, bool& fAhead);
+
+/** Whether the stake data of a block is known, which its children need for their own stake checks. */
+static bool IsBlockStakeReady(const CBlockIndex* pindex)
+{
+    return pindex == NULL || ((pindex->nStatus & BLOCK_HAVE_DATA) && !(pindex->nStatus & BLOCK_STAKE_PENDING));
+}
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -142,6 +175,10 @@ std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
 int nSyncStarted = 0;
 /** All pairs A->B, where A (or one if its ancestors) misses transactions, but B has transactions. */
 std::multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+/** All pairs A->B, where B is stored with BLOCK_STAKE_PENDING until the stake data of A is known. */
+std::multimap<CBlockIndex*, CBlockIndex*> mapBlocksStakePending;
+/** Proof-of-stake headers indexed off the best header chain whose stake is not checked yet, from all peers. */
+std::set<CBlockIndex*> setPoSForkHeaders;
 
 CCriticalSection cs_LastBlockFile;
 std::vector<CBlockFileInfo> vinfoBlockFile;
@@ -168,6 +205,7 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, the compact block waiting for blocktxn.
 };
 std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -177,6 +215,9 @@ int nQueuedValidatedHeaders = 0;
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/** Peers asked to announce new blocks as cmpctblock, oldest first. Protected by cs_main. */
+std::list<NodeId> lNodesAnnouncingCompactBlocks;
+
 /** Dirty block index entries. */
 std::set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -301,6 +342,8 @@ struct CNodeState {
     CBlockIndex* pindexLastCommonBlock;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! Whether headers sync with this peer paused at MAX_POS_HEADERS_AHEAD.
+    bool fHeadersAhead;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     std::list<QueuedBlock> vBlocksInFlight;
@@ -319,6 +362,7 @@ struct CNodeState {
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
+        fHeadersAhead = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
@@ -383,6 +427,7 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingCompactBlocks.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -402,7 +447,7 @@ void MarkBlockAsReceived(const uint256& hash)
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, std::list<QueuedBlock>::iterator* pit = NULL)
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
@@ -415,6 +460,8 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
 }
 
 /** Check whether the last unknown block a peer advertised is not yet known. */
@@ -1057,6 +1104,16 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes)
     return nMinFee;
 }
 
+/** Expire old transactions and evict the cheapest packages until the pool fits -maxmempool */
+void static LimitMempoolSize(CTxMemPool& pool, size_t limit, int64_t age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
 {
     AssertLockHeld(cs_main);
@@ -1187,6 +1244,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         unsigned int nSize = entry.GetTxSize();
 
         if (!ignoreFees) {
+            // Once the pool has been full, only transactions paying more
+            // than what was evicted get in
+            double dPriorityDelta = 0;
+            CAmount nModifiedFees = nFees;
+            pool.ApplyDeltas(hash, dPriorityDelta, nModifiedFees);
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+                return state.Invalid(
+                        error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d", hash.ToString(), nModifiedFees, mempoolRejectFee),
+                        REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             CAmount txMinFee = GetMinRelayFee(tx, nSize);
             if (fLimitFree && nFees < txMinFee)
                 return state.Invalid(
@@ -1230,10 +1298,23 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 //                         nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 //        }
 
+        // Calculate in-mempool ancestors, up to a limit. The limits also bound the
+        // walks that keep the cached package state of the pool up to date.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+            return state.DoS(0, error("AcceptToMemoryPool: too long mempool chain %s: %s", hash.ToString(), errString),
+                    REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+        // Block validation never uses these flags, so only the signatures are cached
         int flags = STANDARD_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-        if (!CheckInputs(tx, state, view, true, flags, true)) {
+        if (!CheckInputs(tx, state, view, true, flags, true, false)) {
             return state.Invalid(
                     error("AcceptToMemoryPool: CheckInputs failed %s", hash.ToString()),
                     REJECT_INVALID, "CheckInputs failed");
@@ -1248,8 +1329,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        flags = MANDATORY_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-        if (!CheckInputs(tx, state, view, true, flags, true)) {
+        //
+        // The block flags include every mandatory one, and passing them here
+        // fills the script execution cache for when the transaction is mined.
+        flags = BLOCK_SCRIPT_VERIFY_FLAGS;
+        if (!CheckInputs(tx, state, view, true, flags, true, true)) {
             return state.Invalid(
                     error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s",
                           hash.ToString()),
@@ -1258,6 +1342,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // Trim the pool, which may evict the transaction itself
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.Invalid(false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1416,7 +1505,7 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         int flags = STANDARD_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-        if (!CheckInputs(tx, state, view, false, flags, true)) {
+        if (!CheckInputs(tx, state, view, false, flags, true, false)) {
             return error("AcceptableInputs: CheckInputs failed %s", hash.ToString());
         }
 
@@ -1584,6 +1673,34 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& block, const CDiskBlockPos& pos)
+{
+    // Seek back to the message start and size written in front of the block
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < 8)
+        return error("%s : invalid position in block file %d pos %u", __func__, pos.nFile, pos.nPos);
+    hpos.nPos -= 8;
+
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed for file %d pos %u", __func__, pos.nFile, pos.nPos);
+
+    try {
+        MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+        if (memcmp(blkStart, Params().MessageStart(), MESSAGE_START_SIZE))
+            return error("%s : block magic mismatch in file %d pos %u", __func__, pos.nFile, pos.nPos);
+        if (nSize > MAX_BLOCK_SIZE_CURRENT)
+            return error("%s : block data larger than maximum in file %d pos %u", __func__, pos.nFile, pos.nPos);
+        block.resize(nSize);
+        filein.read((char*)&block[0], nSize);
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -1722,12 +1839,14 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
+// Takes cs_main, as the masternode handlers call this from outside it.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
+
     CNodeState* state = State(pnode);
     if (state == NULL)
         return;
@@ -1801,7 +1920,24 @@ bool CScriptCheck::operator()()
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+/**
+ * Transactions whose scripts all passed with a given set of flags, keyed by a
+ * salted hash of (txid, flags). Mempool acceptance fills it, so that
+ * connecting a block with the same transactions skips their scripts.
+ * Protected by cs_main.
+ */
+static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce(GetRandHash());
+
+void InitScriptExecutionCache()
+{
+    size_t nMaxCacheSize = GetSignatureCacheBytes();
+    size_t nEntries = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %zu elements\n",
+        (nEntries * sizeof(uint256)) >> 20, nMaxCacheSize >> 20, nEntries);
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, bool cacheFullScriptStore, std::vector<CScriptCheck>* pvChecks)
 {
     if (!tx.IsCoinBase()) {
         if (pvChecks)
@@ -1862,6 +1998,14 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // The txid commits to the spent outputs, so a transaction whose scripts passed
+            // with these flags before passes again. Entries used by a block are not needed again.
+            uint256 hashCacheEntry;
+            CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetHash().begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            AssertLockHeld(cs_main);
+            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
@@ -1895,6 +2039,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                     return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Only cache what was checked here, not checks deferred to the caller
+            if (cacheFullScriptStore && !pvChecks)
+                scriptExecutionCache.insert(hashCacheEntry);
         }
     }
 
@@ -1959,14 +2107,17 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 const CTxInUndo& undo = txundo.vprevout[j];
                 CCoinsModifier coins = view.ModifyCoins(out.hash);
                 if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
+                    // undo data contains the metadata of the prevout tx, which must match its other unspent outputs
+                    if (coins->IsPruned()) {
+                        coins->Clear();
+                        coins->fCoinBase = undo.fCoinBase;
+                        coins->fCoinStake = undo.fCoinStake;
+                        coins->nHeight = undo.nHeight;
+                        coins->nVersion = undo.nVersion;
+                    } else if (coins->fCoinBase != undo.fCoinBase || coins->fCoinStake != undo.fCoinStake || coins->nHeight != (int)undo.nHeight || coins->nVersion != undo.nVersion)
+                        fClean = fClean && error("DisconnectBlock() : undo data mismatching existing transaction");
                 } else {
+                    // undo data of older versions only has the metadata for the last output of the prevout tx being spent
                     if (coins->IsPruned())
                         fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
                 }
@@ -2023,6 +2174,140 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+/** Number of times pcoinsTip was flushed to the coins database */
+static uint64_t nCoinsTipFlushes = 0;
+
+/**
+ * Reads the next block ConnectTip will connect during initial block download from the
+ * network, and fetches its inputs from the coins database, on ThreadBlockPrefetch. The
+ * disk reads of block N+1 then overlap with connecting block N and its script checks on
+ * the -par threads.
+ */
+class CBlockPrefetch
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    //! Requested block, NULL when there is none
+    const CBlockIndex* pindex;
+    uint256 hash;
+    CDiskBlockPos pos;
+    CCoinsView* pcoinsBase;
+    //! nCoinsTipFlushes when requested; coins read across a flush may be stale
+    uint64_t nFlushes;
+    //! The thread picked up the request
+    bool fStarted;
+    bool fDone;
+    bool fOk;
+
+    CBlock block;
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+
+public:
+    CBlockPrefetch() : pindex(NULL), pcoinsBase(NULL), nFlushes(0), fStarted(false), fDone(false), fOk(false) {}
+
+    // requires cs_main
+    void Request(const CBlockIndex* pindexIn, CCoinsView* pcoinsBaseIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pindex == pindexIn)
+            return;
+        pindex = pindexIn;
+        hash = pindexIn->GetBlockHash();
+        pos = pindexIn->GetBlockPos();
+        pcoinsBase = pcoinsBaseIn;
+        nFlushes = nCoinsTipFlushes;
+        fStarted = fDone = fOk = false;
+        cond.notify_all();
+    }
+
+    /**
+     * Hand out the block and the coins of its inputs if they were read ahead. A request the
+     * thread did not start yet is dropped, the caller reads the block itself.
+     */
+    bool Take(const CBlockIndex* pindexIn, CBlock& blockOut, std::vector<std::pair<uint256, CCoins> >& vCoinsOut, uint64_t& nFlushesOut)
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pindex != pindexIn)
+            return false;
+        while (fStarted && !fDone)
+            cond.wait(lock);
+        bool fRet = fStarted && fOk;
+        if (fRet) {
+            std::swap(blockOut, block);
+            vCoinsOut.swap(vCoins);
+            nFlushesOut = nFlushes;
+        }
+        pindex = NULL;
+        block.SetNull();
+        vCoins.clear();
+        return fRet;
+    }
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (pindex == NULL || fStarted)
+                cond.wait(lock);
+            fStarted = true;
+            const CBlockIndex* pindexRead = pindex;
+            uint256 hashRead = hash;
+            CDiskBlockPos posRead = pos;
+            CCoinsView* pcoinsRead = pcoinsBase;
+            lock.unlock();
+
+            CBlock blockRead;
+            std::vector<std::pair<uint256, CCoins> > vCoinsRead;
+            bool fRead = false;
+            try {
+                fRead = ReadBlockFromDisk(blockRead, posRead) && blockRead.GetHash() == hashRead;
+                if (fRead) {
+                    // Outputs created within the block are not in the database yet
+                    std::set<uint256> setSeen;
+                    for (const CTransaction& tx : blockRead.vtx)
+                        setSeen.insert(tx.GetHash());
+                    for (const CTransaction& tx : blockRead.vtx) {
+                        if (tx.IsCoinBase())
+                            continue;
+                        for (const CTxIn& txin : tx.vin) {
+                            if (!setSeen.insert(txin.prevout.hash).second)
+                                continue;
+                            CCoins coins;
+                            if (pcoinsRead->GetCoins(txin.prevout.hash, coins)) {
+                                vCoinsRead.push_back(std::make_pair(txin.prevout.hash, CCoins()));
+                                vCoinsRead.back().second.swap(coins);
+                            }
+                        }
+                    }
+                }
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+                fRead = false;
+            }
+
+            lock.lock();
+            if (pindex == pindexRead && !fDone) {
+                std::swap(block, blockRead);
+                vCoins.swap(vCoinsRead);
+                fOk = fRead;
+                fDone = true;
+                cond.notify_all();
+            }
+        }
+    }
+};
+
+static CBlockPrefetch blockPrefetch;
+
+void ThreadBlockPrefetch()
+{
+    RenameThread("prefetch");
+    blockPrefetch.Thread();
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -2116,9 +2401,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             nValueIn += view.GetValueIn(tx);
 
             std::vector<CScriptCheck> vChecks;
-            unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+            unsigned int flags = BLOCK_SCRIPT_VERIFY_FLAGS;
 
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            // A just-check run (TestBlockValidity) leaves the cache entries for the real connect
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fJustCheck, fJustCheck, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2230,8 +2516,9 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
+        bool fCacheFull = pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage;
         if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && fCacheFull) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -2261,8 +2548,12 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
                 }
             }
             // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // The unmodified coins stay in memory, only trim them when over the limit.
+            if (!pcoinsTip->Sync())
                 return state.Abort("Failed to write to coin database");
+            if (fCacheFull)
+                pcoinsTip->Trim(nCoinCacheUsage / 100 * COINS_CACHE_KEEP_PERCENT);
+            nCoinsTipFlushes++;
             // Update best block in wallet (so we can detect restored wallets).
             if (!fPreventBestBlockSaving && mode != FLUSH_STATE_IF_NEEDED) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -2285,15 +2576,17 @@ void FlushStateToDisk()
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    chainActiveHashes.SetTip();
+    stakeModifierIndex.SetTip(chainActive.Tip());
 
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d version=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d version=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), chainActive.Tip()->nVersion, log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2370,9 +2663,10 @@ static int64_t nTimePostConnect = 0;
 
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
- * corresponding to pindexNew, to bypass loading it again from disk.
+ * corresponding to pindexNew, to bypass loading it again from disk. pindexNext is read
+ * ahead with its inputs while this block connects.
  */
-bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock* pblock, bool fAlreadyChecked)
+bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock* pblock, bool fAlreadyChecked, const CBlockIndex* pindexNext = NULL)
 {
     assert(pindexNew->pprev == chainActive.Tip());
     mempool.check(pcoinsTip);
@@ -2385,15 +2679,33 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        std::vector<std::pair<uint256, CCoins> > vCoins;
+        uint64_t nFlushes;
+        if (blockPrefetch.Take(pindexNew, block, vCoins, nFlushes)) {
+            // Coins read before the last flush may be older than the database
+            if (nFlushes == nCoinsTipFlushes)
+                for (std::pair<uint256, CCoins>& coins : vCoins)
+                    pcoinsTip->PrefetchCoins(coins.first, coins.second);
+        } else if (!ReadBlockFromDisk(block, pindexNew)) {
             return state.Abort("Failed to read block");
+        }
         pblock = &block;
     }
+    if (pindexNext)
+        blockPrefetch.Request(pindexNext, pcoinsTip->GetBackend());
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros();
     nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    if (pindexNew->nStatus & BLOCK_STAKE_PENDING) {
+        if (!CheckPendingStake(*pblock, state, pindexNew)) {
+            if (state.IsInvalid())
+                InvalidBlockFound(pindexNew, state);
+            return error("ConnectTip() : CheckPendingStake %s failed", pindexNew->GetBlockHash().ToString());
+        }
+        CheckPendingStakeChildren(pindexNew);
+    }
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
@@ -2642,9 +2954,15 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         }
         nHeight = nTargetHeight;
 
-        // Connect new blocks.
+        // Connect new blocks. Only a block already known past pindexConnect is read ahead,
+        // so -reindex and -loadblock, which hand blocks to ProcessNewBlock one at a time,
+        // do not use the prefetch.
+        bool fPrefetch = IsInitialBlockDownload();
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
-            if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked)) {
+            const CBlockIndex* pindexNext = NULL;
+            if (fPrefetch && pindexConnect != pindexMostWork)
+                pindexNext = pindexMostWork->GetAncestor(pindexConnect->nHeight + 1);
+            if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked, pindexNext)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -2718,10 +3036,28 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
+                // Peers that asked for it get the new tip right away as a compact block, saving the inv and getdata round trip
+                std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                if (pblock && pblock->GetHash() == hashNewTip)
+                    pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
+                CInv inv(MSG_BLOCK, hashNewTip);
                 LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                for (CNode* pnode : vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (pcmpctblock && pnode->fAnnounceCompactBlocks) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->filterInventoryKnown.contains(inv);
+                        }
+                        if (!fKnown) {
+                            pnode->AddInventoryKnown(inv);
+                            pnode->PushMessage("cmpctblock", *pcmpctblock);
+                        }
+                    } else
+                        pnode->PushInventory(inv);
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -2816,7 +3152,7 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlock& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 {
     AssertLockHeld(cs_main);
 
@@ -2845,12 +3181,43 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
+    }
+
+    pindexNew->nDynamicMultiplier = pindexNew->pprev ? pindexNew->pprev->nDynamicMultiplier : DYNAMIC_MULTIPLIER_DEFAULT * DYNAMIC_MULTIPLIER_DIVIDER;
+
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
+    pindexNew->RaiseValidity(BLOCK_VALID_TREE);
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+        pindexBestHeader = pindexNew;
+
+    //update previous block pointer
+    if (pindexNew->nHeight)
+        pindexNew->pprev->pnext = pindexNew;
+
+    setDirtyBlockIndex.insert(pindexNew);
+
+    return pindexNew;
+}
+
+/** Fill in the index fields that need the block body and the stake data of the parent. */
+void SetBlockIndexStakeData(CBlockIndex* pindexNew, const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    setPoSForkHeaders.erase(pindexNew);
+
+    uint256 hash = block.GetHash();
+    if (block.IsProofOfStake()) {
+        pindexNew->SetProofOfStake();
+        pindexNew->prevoutStake = block.vtx[1].vin[0].prevout;
+        pindexNew->nStakeTime = block.nTime;
+    }
+
+    if (pindexNew->pprev) {
+        // ppcoin: compute chain trust score
+        pindexNew->bnChainTrust = pindexNew->pprev->bnChainTrust + pindexNew->GetBlockTrust();
 
         // ppcoin: record proof-of-stake hash value
         if (pindexNew->IsProofOfStake()) {
@@ -2912,20 +3279,72 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->nMint = pindexNew->nMoneySupply - nMoneySupplyPrev + nFees;
     }
 
-    pindexNew->nDynamicMultiplier = pindexNew->pprev ? pindexNew->pprev->nDynamicMultiplier : DYNAMIC_MULTIPLIER_DEFAULT * DYNAMIC_MULTIPLIER_DIVIDER;
+    setDirtyBlockIndex.insert(pindexNew);
+}
 
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
-    pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
-        pindexBestHeader = pindexNew;
+/** Run the stake checks AcceptBlock left for when the stake data of the parent is known. */
+static bool CheckPendingStake(const CBlock& block, CValidationState& state, CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    assert(IsBlockStakeReady(pindex->pprev));
 
-    //update previous block pointer
-    if (pindexNew->nHeight)
-        pindexNew->pprev->pnext = pindexNew;
+    if (block.IsProofOfStake()) {
+        if (!IsBlockPayeeValid(block, pindex->nHeight, pindex->pprev->nMoneySupply)) {
+            mapRejectedBlocks.insert(std::make_pair(block.GetHash(), GetTime()));
+            return state.DoS(0, error("%s : Couldn't find some payments", __func__),
+                    REJECT_INVALID, "bad-cb-payee");
+        }
 
-    setDirtyBlockIndex.insert(pindexNew);
+        uint256 hashProofOfStake = 0;
+        std::unique_ptr<CStakeInput> stake;
+        if (!CheckProofOfStake(block, hashProofOfStake, stake, pindex->pprev->nHeight))
+            return state.DoS(100, error("%s: proof of stake check failed", __func__));
 
-    return pindexNew;
+        uint256 hash = block.GetHash();
+        if (!mapProofOfStake.count(hash))
+            mapProofOfStake.insert(std::make_pair(hash, hashProofOfStake));
+    }
+
+    SetBlockIndexStakeData(pindex, block);
+    pindex->nStatus &= ~BLOCK_STAKE_PENDING;
+    return true;
+}
+
+/** Check the stake of the blocks stored ahead of pindexReady, and of their descendants, now that its stake data is known. */
+static void CheckPendingStakeChildren(CBlockIndex* pindexReady)
+{
+    AssertLockHeld(cs_main);
+
+    std::deque<CBlockIndex*> queue;
+    queue.push_back(pindexReady);
+    while (!queue.empty()) {
+        CBlockIndex* pindex = queue.front();
+        queue.pop_front();
+
+        std::vector<CBlockIndex*> vChildren;
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksStakePending.equal_range(pindex);
+        for (std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first; it != range.second; ++it)
+            vChildren.push_back(it->second);
+        mapBlocksStakePending.erase(range.first, range.second);
+
+        for (CBlockIndex* pindexChild : vChildren) {
+            if (!(pindexChild->nStatus & BLOCK_STAKE_PENDING) || (pindexChild->nStatus & BLOCK_FAILED_MASK))
+                continue;
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexChild)) {
+                // ConnectTip checks it then
+                LogPrintf("%s : failed to read block %s\n", __func__, pindexChild->GetBlockHash().ToString());
+                continue;
+            }
+            CValidationState state;
+            if (!CheckPendingStake(block, state, pindexChild)) {
+                if (state.IsInvalid())
+                    InvalidBlockFound(pindexChild, state);
+                continue;
+            }
+            queue.push_back(pindexChild);
+        }
+    }
 }
 
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
@@ -3069,6 +3488,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     CBlockIndex* pindexPrev = chainActive.Tip();
     int nHeight = 0;
     int64_t prevMoneySupply = 0;
+    bool fMoneySupplyKnown = true;
 
     if (pindexPrev != NULL) {
         if (pindexPrev->GetBlockHash() == block.hashPrevBlock) {
@@ -3079,6 +3499,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             if (mi != mapBlockIndex.end() && (*mi).second) {
                 nHeight = (*mi).second->nHeight + 1;
                 prevMoneySupply = (*mi).second->nMoneySupply;
+                // Downloaded ahead of its parent's body, payments are checked when it is connected
+                fMoneySupplyKnown = IsBlockStakeReady((*mi).second);
             }
         }
     }
@@ -3166,7 +3588,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
 
     // masternode payments
-    if (block.IsProofOfStake()) {
+    if (block.IsProofOfStake() && fMoneySupplyKnown) {
         // It is entierly possible that we don't have enough data and this could fail
         // (i.e. the block could indeed be valid). Store the block for later consideration
         // but issue an initial reject message.
@@ -3225,7 +3647,8 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
 
     int nHeight = pindexPrev->nHeight + 1;
 
-    if ((Params().NetworkID() == CBaseChainParams::REGTEST) && block.nBits != GetNextWorkRequired(pindexPrev, &block))
+    // Difficulty only depends on the headers, check it before the body is downloaded
+    if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
         return state.DoS(100, error("%s : incorrect proof of work", __func__),
                 REJECT_INVALID, "bad-diffbits");
 
@@ -3303,7 +3726,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3330,11 +3753,20 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
         pindexPrev = (*mi).second;
     }
 
-    if (!CheckBlockHeader(block, pindexPrev ? (pindexPrev->nHeight + 1) : 0, state, false)) {
+    // A header does not tell whether the block is proof-of-stake, but the height does: blocks up to
+    // LAST_POW_BLOCK must be proof-of-work and later ones proof-of-stake
+    const int nHeight = pindexPrev ? (pindexPrev->nHeight + 1) : 0;
+    const bool fProofOfStake = nHeight > Params().LAST_POW_BLOCK();
+    if (!CheckBlockHeader(block, nHeight, state, pindexPrev && !fProofOfStake)) {
         LogPrintf("AcceptBlockHeader(): CheckBlockHeader failed \n");
         return false;
     }
 
+    if (Params().NetworkID() != CBaseChainParams::REGTEST &&
+            block.GetBlockTime() > Params().MaxFutureBlockTime(GetAdjustedTime(), fProofOfStake))
+        return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+            REJECT_INVALID, "time-too-new");
+
     // Get prev block index
     if (hash != Params().HashGenesisBlock()) {
         if (pindexPrev->nStatus & BLOCK_FAILED_MASK) {
@@ -3358,8 +3790,13 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
         return false;
 
-    if (pindex == NULL)
+    if (pindex == NULL) {
+        // Checked against MAX_POS_FORK_HEADERS by CheckPoSHeaderBudget until the block's stake is checked
+        const bool fPoSFork = fProofOfStake && pindexPrev != pindexBestHeader;
         pindex = AddToBlockIndex(block);
+        if (fPoSFork)
+            setPoSForkHeaders.insert(pindex);
+    }
 
     if (ppindex)
         *ppindex = pindex;
@@ -3367,6 +3804,32 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
+static BlockSpendsMap::iterator AddRecentBlockSpends(const CBlock& block, const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    std::set<COutPoint>& setSpent = mapRecentBlockSpends[pindex];
+    for (const CTransaction& tx : block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        for (const CTxIn& in : tx.vin)
+            setSpent.insert(in.prevout);
+    }
+    return mapRecentBlockSpends.find(pindex);
+}
+
+/** Forget blocks too far below the tip for a fork through them to be accepted. */
+static void PruneRecentBlockSpends()
+{
+    AssertLockHeld(cs_main);
+    const int nMinHeight = chainActive.Height() - Params().MaxReorganizationDepth();
+    for (BlockSpendsMap::iterator it = mapRecentBlockSpends.begin(); it != mapRecentBlockSpends.end();) {
+        if (it->first->nHeight < nMinHeight)
+            mapRecentBlockSpends.erase(it++);
+        else
+            ++it;
+    }
+}
+
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock)
 {
     AssertLockHeld(cs_main);
@@ -3399,8 +3862,17 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
     if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
         return false;
 
+    // Blocks downloaded ahead of their parent's body are stored now and have
+    // their stake checked once the parent's stake data is known
+    const bool fStakeReady = IsBlockStakeReady(pindexPrev);
+
+    // Until then a new one is no better checked than a header
+    bool fAhead;
+    if (block.IsProofOfStake() && !fStakeReady && dbp == NULL && !CheckPoSHeaderBudget(block, fAhead))
+        return error("%s : too many proof-of-stake blocks waiting for their stake check, ignoring %s", __func__, block.GetHash().GetHex());
+
     bool isPoS = false;
-    if (block.IsProofOfStake()) {
+    if (block.IsProofOfStake() && fStakeReady) {
         isPoS = true;
         uint256 hashProofOfStake = 0;
         std::unique_ptr<CStakeInput> stake;
@@ -3465,10 +3937,6 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
             // Start at the block we're adding on to
             CBlockIndex *prev = pindexPrev;
 
-            CBlock bl;
-            if (!ReadBlockFromDisk(bl, prev))
-                return error("%s: previous block %s not on disk", __func__, prev->GetBlockHash().GetHex());
-
             int readBlock = 0;
             // Go backwards on the forked chain up to the split
             while (!chainActive.Contains(prev)) {
@@ -3481,25 +3949,26 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
                     return error("%s: forked chain longer than maximum reorg limit", __func__);
                 }
 
-                // Loop through every input from said block
-                for (const CTransaction &t : bl.vtx) {
-                    for (const CTxIn &in: t.vin) {
-                        // Loop through every input of the staking tx
-                        for (const CTxIn &stakeIn : stakeTxIn.vin) {
-                            // if it's already spent
-                            if (stakeIn.prevout == in.prevout) {
-                                return state.DoS(100, error("%s: input already spent on a previous block", __func__));
-                            }
-                        }
+                // Blocks accepted since startup are indexed, older ones are read once
+                BlockSpendsMap::iterator it = mapRecentBlockSpends.find(prev);
+                if (it == mapRecentBlockSpends.end()) {
+                    CBlock bl;
+                    if (!ReadBlockFromDisk(bl, prev))
+                        // Previous block not on disk
+                        return error("%s: previous block %s not on disk", __func__, prev->GetBlockHash().GetHex());
+                    it = AddRecentBlockSpends(bl, prev);
+                }
+
+                // Loop through every input of the staking tx
+                for (const CTxIn &stakeIn : stakeTxIn.vin) {
+                    // if it's already spent
+                    if (it->second.count(stakeIn.prevout)) {
+                        return state.DoS(100, error("%s: input already spent on a previous block", __func__));
                     }
                 }
 
                 // Prev block
                 prev = prev->pprev;
-                if (!ReadBlockFromDisk(bl, prev))
-                    // Previous block not on disk
-                    return error("%s: previous block %s not on disk", __func__, prev->GetBlockHash().GetHex());
-
             }
         }
 
@@ -3520,6 +3989,13 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         }
     }
 
+    if (fStakeReady) {
+        SetBlockIndexStakeData(pindex, block);
+    } else {
+        pindex->nStatus |= BLOCK_STAKE_PENDING;
+        mapBlocksStakePending.insert(std::make_pair(pindex->pprev, pindex));
+    }
+
     // Write block to history file
     try {
         unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
@@ -3537,6 +4013,12 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return state.Abort(std::string("System error: ") + e.what());
     }
 
+    AddRecentBlockSpends(block, pindex);
+    PruneRecentBlockSpends();
+
+    if (fStakeReady)
+        CheckPendingStakeChildren(pindex);
+
     return true;
 }
 
@@ -3651,6 +4133,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         return error("%s : ActivateBestChain failed", __func__);
 
     if (!fLiteMode) {
+        mnodeman.ClearScoreTables();
         if (masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
             obfuScationPool.NewBlock();
             masternodePayments.ProcessBlock(GetHeight() + 10);
@@ -3807,6 +4290,8 @@ bool static LoadBlockIndexDB(std::string& strError)
                     pindex->nChainTx = 0;
                     mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
                 }
+                if (pindex->nStatus & BLOCK_STAKE_PENDING)
+                    mapBlocksStakePending.insert(std::make_pair(pindex->pprev, pindex));
             } else {
                 pindex->nChainTx = pindex->nTx;
             }
@@ -3876,6 +4361,8 @@ bool static LoadBlockIndexDB(std::string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    chainActiveHashes.SetTip();
+    stakeModifierIndex.SetTip(chainActive.Tip());
 
     PruneBlockIndexCandidates();
 
@@ -3937,7 +4424,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check for inconsistencies during memory-only disconnect of tip blocks
-        if (pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3977,13 +4464,18 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    chainActiveHashes.SetTip();
+    stakeModifierIndex.SetTip(chainActive.Tip());
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapRecentBlockSpends.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
+    mapBlocksStakePending.clear();
+    setPoSForkHeaders.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
     nBlockSequenceId = 1;
@@ -4033,6 +4525,7 @@ bool InitBlockIndex()
             if (!WriteBlockToDisk(block, blockPos))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
             CBlockIndex* pindex = AddToBlockIndex(block);
+            SetBlockIndexStakeData(pindex, block);
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
             if (!ActivateBestChain(state, &block))
@@ -4211,6 +4704,7 @@ void static CheckBlockIndex()
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
         assert(pindexFirstNotTreeValid == NULL);                                                                     // All mapBlockIndex entries must at least be TREE valid
+        if (pindex->nStatus & BLOCK_STAKE_PENDING) assert((pindex->nStatus & BLOCK_HAVE_DATA) && !chainActive.Contains(pindex)); // Stake is checked before a block is connected
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TREE) assert(pindexFirstNotTreeValid == NULL);       // TREE valid implies all parents are TREE valid
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_CHAIN) assert(pindexFirstNotChainValid == NULL);     // CHAIN valid implies all parents are CHAIN valid
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_SCRIPTS) assert(pindexFirstNotScriptsValid == NULL); // SCRIPTS valid implies all parents are SCRIPTS valid
@@ -4348,6 +4842,28 @@ std::string GetWarnings(std::string strFor)
 // Messages
 //
 
+/**
+ * Serializes the message handlers that share state outside cs_main (spork, SwiftX and
+ * orphan tx relay state) across the message handler threads. The masternode list and
+ * payment handlers are serialized by mnodeman.cs_process_message and the payment locks
+ * instead. Lock order is CNode::cs_vRecvMsg, cs_serialMessages, mnodeman.cs_process_message,
+ * cs_main.
+ */
+static CCriticalSection cs_serialMessages;
+
+/**
+ * Commands whose handlers only touch the peer's own state, or shared state under cs_main
+ * and the structures' own locks, and so run on all message handler threads at once.
+ */
+static bool IsConcurrentMessage(const std::string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong" || strCommand == "getdata" ||
+           strCommand == "getblocks" || strCommand == "getheaders" || strCommand == "getblocktxn" || strCommand == "sendcmpct" ||
+           (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) ||
+           strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear" ||
+           strCommand == "mnb" || strCommand == "mnp" || strCommand == "dseg" || strCommand == "dsee" || strCommand == "dseep" ||
+           strCommand == "mnw" || strCommand == "mnget";
+}
 
 bool static AlreadyHave(const CInv& inv)
 {
@@ -4355,7 +4871,7 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
-        return txInMap || mapOrphanTransactions.count(inv.hash) ||
+        return RecentRejects().contains(inv.hash) || txInMap || mapOrphanTransactions.count(inv.hash) ||
                pcoinsTip->HaveCoins(inv.hash);
     }
     case MSG_BLOCK:
@@ -4367,19 +4883,23 @@ bool static AlreadyHave(const CInv& inv)
         return mapTxLockVote.count(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
-    case MSG_MASTERNODE_WINNER:
+    case MSG_MASTERNODE_WINNER: {
+        LOCK(cs_mapMasternodePayeeVotes);
         if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
             return true;
         }
         return false;
+    }
     case MSG_MASTERNODE_ANNOUNCE:
+        AssertLockHeld(mnodeman.cs_process_message);
         if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
             masternodeSync.AddedMasternodeList(inv.hash);
             return true;
         }
         return false;
     case MSG_MASTERNODE_PING:
+        AssertLockHeld(mnodeman.cs_process_message);
         return mnodeman.mapSeenMasternodePing.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
@@ -4387,14 +4907,39 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Serialized blocks recently sent to peers, most recent first. New blocks are requested by every peer at once. */
+static CCriticalSection cs_rawBlockCache;
+static std::list<std::pair<uint256, std::shared_ptr<const CDataStream> > > lruRawBlocks;
+
+static std::shared_ptr<const CDataStream> GetRawBlock(const uint256& hash, const CDiskBlockPos& pos)
+{
+    {
+        LOCK(cs_rawBlockCache);
+        for (auto it = lruRawBlocks.begin(); it != lruRawBlocks.end(); ++it) {
+            if (it->first == hash) {
+                lruRawBlocks.splice(lruRawBlocks.begin(), lruRawBlocks, it);
+                return it->second;
+            }
+        }
+    }
+
+    std::shared_ptr<CDataStream> pblock = std::make_shared<CDataStream>(SER_NETWORK, PROTOCOL_VERSION);
+    if (!ReadRawBlockFromDisk(*pblock, pos))
+        return NULL;
+
+    LOCK(cs_rawBlockCache);
+    lruRawBlocks.push_front(std::make_pair(hash, pblock));
+    if (lruRawBlocks.size() > RAW_BLOCK_CACHE_SIZE)
+        lruRawBlocks.pop_back();
+    return pblock;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     std::vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4405,33 +4950,57 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
+                CBlockIndex* pindexSend = NULL;
+                uint256 hashTip;
+                int nHeightTip;
+                {
+                    LOCK(cs_main);
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end()) {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a max reorg depth than the best header
+                            // chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                   (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
                         }
                     }
+                    // Don't send not-validated blocks
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                        pindexSend = mi->second;
+                    hashTip = chainActive.Tip()->GetBlockHash();
+                    nHeightTip = chainActive.Height();
                 }
-                // Don't send not-validated blocks
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                // Block data never moves once stored, so the disk read does not need cs_main
+                if (pindexSend) {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    if (inv.type == MSG_BLOCK) {
+                        // Serialization is the same on disk and on the wire, send the stored bytes as they are
+                        std::shared_ptr<const CDataStream> pblock = GetRawBlock(inv.hash, pindexSend->GetBlockPos());
+                        if (!pblock)
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", *pblock);
+                    } else if (inv.type == MSG_CMPCT_BLOCK) {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, pindexSend))
+                            assert(!"cannot load block from disk");
+                        // The peer's mempool has no use for the short IDs of old blocks, send those in full
+                        if (pfrom->fSupportsCompactBlocks && nHeightTip - pindexSend->nHeight < MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, pindexSend))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -4444,7 +5013,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             for (PairType& pair : merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -4457,12 +5026,14 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         std::vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
                 }
             } else if (inv.IsKnownType()) {
+                LOCK(cs_serialMessages);
+                LOCK2(mnodeman.cs_process_message, cs_main);
                 // Send stream from relay memory
                 bool pushed = false;
                 {
@@ -4513,6 +5084,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
+                    LOCK(cs_mapMasternodePayeeVotes);
                     if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4570,6 +5142,104 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/** Whether blocks are synced from this peer by headers first rather than by getblocks and inv. */
+static bool IsHeadersFirstPeer(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/**
+ * Proof-of-stake headers carry no stake proof, so indexing them is free for the peer. Returns false
+ * if the header is too far past the active tip, setting fAhead, or if MAX_POS_FORK_HEADERS headers
+ * off the best header chain, from all peers together, are already waiting for their stake check.
+ */
+static bool CheckPoSHeaderBudget(const CBlockHeader& header, bool& fAhead)
+{
+    AssertLockHeld(cs_main);
+    fAhead = false;
+    if (mapBlockIndex.count(header.GetHash()))
+        return true;
+    BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi == mapBlockIndex.end())
+        return true; // AcceptBlockHeader rejects it
+    CBlockIndex* pindexPrev = mi->second;
+    int nHeight = pindexPrev->nHeight + 1;
+    if (nHeight <= Params().LAST_POW_BLOCK())
+        return true;
+
+    if (nHeight > chainActive.Height() + MAX_POS_HEADERS_AHEAD) {
+        fAhead = true;
+        return false;
+    }
+    if (pindexPrev != pindexBestHeader) {
+        // Forget the headers that can no longer be reorganized to or turned out invalid
+        const int nMinHeight = chainActive.Height() - Params().MaxReorganizationDepth();
+        for (std::set<CBlockIndex*>::iterator it = setPoSForkHeaders.begin(); it != setPoSForkHeaders.end();) {
+            if ((*it)->nHeight <= nMinHeight || ((*it)->nStatus & BLOCK_FAILED_MASK))
+                setPoSForkHeaders.erase(it++);
+            else
+                ++it;
+        }
+        if (setPoSForkHeaders.size() >= (size_t)MAX_POS_FORK_HEADERS)
+            return false;
+    }
+    return true;
+}
+
+/** Validate and store a block a peer sent us, rejecting it back to the peer if it is invalid. */
+// Ask a peer that just gave us our new tip to announce its next blocks as cmpctblock,
+// taking the slot of the oldest of the MAX_CMPCT_ANNOUNCING_PEERS already asked (BIP152)
+static void MaybeSetPeerAsAnnouncingCompactBlocks(CNode* pfrom)
+{
+    NodeId nodeStop = -1;
+    {
+        LOCK(cs_main);
+        if (std::find(lNodesAnnouncingCompactBlocks.begin(), lNodesAnnouncingCompactBlocks.end(), pfrom->GetId()) != lNodesAnnouncingCompactBlocks.end())
+            return;
+        if (lNodesAnnouncingCompactBlocks.size() >= MAX_CMPCT_ANNOUNCING_PEERS) {
+            nodeStop = lNodesAnnouncingCompactBlocks.front();
+            lNodesAnnouncingCompactBlocks.pop_front();
+        }
+        lNodesAnnouncingCompactBlocks.push_back(pfrom->GetId());
+    }
+    if (nodeStop != -1) {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (pnode->GetId() == nodeStop) {
+                pnode->PushMessage("sendcmpct", false, COMPACT_BLOCKS_ENCODING_VERSION);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, COMPACT_BLOCKS_ENCODING_VERSION);
+}
+
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    if (state.IsValid() && pfrom->fSupportsCompactBlocks && !IsInitialBlockDownload()) {
+        bool fNewTip;
+        {
+            LOCK(cs_main);
+            fNewTip = chainActive.Tip() && chainActive.Tip()->GetBlockHash() == block.GetHash();
+        }
+        if (fNewTip)
+            MaybeSetPeerAsAnnouncingCompactBlocks(pfrom);
+    }
+    int nDoS;
+    if(state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if(nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+    //disconnect this node if its old protocol version
+    pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+}
+
 bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -4713,6 +5383,22 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Fetch blocks from this peer as compact blocks, only the few peers picked by
+        // MaybeSetPeerAsAnnouncingCompactBlocks send them without an inv first
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", false, COMPACT_BLOCKS_ENCODING_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounce;
+        uint64_t nEncodingVersion;
+        vRecv >> fAnnounce >> nEncodingVersion;
+        if (nEncodingVersion == COMPACT_BLOCKS_ENCODING_VERSION) {
+            pfrom->fSupportsCompactBlocks = true;
+            pfrom->fAnnounceCompactBlocks = fAnnounce;
+        }
     }
 
 
@@ -4745,7 +5431,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -4788,7 +5474,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             return error("message inv size() = %u", vInv.size());
         }
 
-        LOCK(cs_main);
+        LOCK2(mnodeman.cs_process_message, cs_main);
 
         std::vector<CInv> vToFetch;
 
@@ -4808,9 +5494,22 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (IsHeadersFirstPeer(pfrom)) {
+                        // First request the headers preceding the announced block, so that the block connects
+                        // to a known header when it arrives. When close to synced also request the block right
+                        // away to save a round trip, otherwise it is fetched by FindNextBlocksToDownload.
+                        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                        if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20) {
+                            // A new block most likely holds transactions our mempool has already
+                            vToFetch.push_back(CInv(pfrom->fSupportsCompactBlocks ? MSG_CMPCT_BLOCK : MSG_BLOCK, inv.hash));
+                            MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        }
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    } else {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -4848,7 +5547,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4880,7 +5579,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4988,6 +5687,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
                         // Probably non-standard or insufficient fee/priority
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
                         vEraseQueue.push_back(orphanHash);
+                        RecentRejects().insert(orphanHash);
                     }
                     mempool.check(pcoinsTip);
                 }
@@ -5002,12 +5702,16 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
+        } else {
+            RecentRejects().insert(tx.GetHash());
 
-            RelayTransaction(tx);
+            if (pfrom->fWhitelisted) {
+                // Always relay transactions received from whitelisted peers, even
+                // if they are already in the mempool (allowing the node to function
+                // as a gateway for nodes hidden behind it).
+
+                RelayTransaction(tx);
+            }
         }
 
         int nDoS = 0;
@@ -5047,6 +5751,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             return true;
         }
         CBlockIndex* pindexLast = NULL;
+        bool fOverBudget = false;
         for (const CBlockHeader& header : headers) {
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
@@ -5054,10 +5759,20 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
+            bool fAhead;
+            if (!CheckPoSHeaderBudget(header, fAhead)) {
+                if (fAhead) {
+                    // Continue from here once the blocks caught up, see SendMessages
+                    State(pfrom->GetId())->fHeadersAhead = true;
+                } else {
+                    LogPrint("net", "too many proof-of-stake headers off the best chain, ignoring the rest from peer=%d\n", pfrom->id);
+                }
+                fOverBudget = true;
+                break;
+            }
+
+            // Only the checks a header allows are done here, the stake is checked once the block is downloaded
+            if (!AcceptBlockHeader(header, state, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5071,7 +5786,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (nCount == MAX_HEADERS_RESULTS && pindexLast && !fOverBudget) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -5090,8 +5805,23 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
         CInv inv(MSG_BLOCK, hashBlock);
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
+        // "headers" may be indexing on another thread, so look the block index up under cs_main
+        bool fHavePrev, fHaveData;
+        {
+            LOCK(cs_main);
+            fHavePrev = mapBlockIndex.count(block.hashPrevBlock) > 0;
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            fHaveData = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+        }
+
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        if (!fHavePrev && IsHeadersFirstPeer(pfrom)) {
+            // Fetch the missing headers, the block itself is downloaded again once they connect
+            LOCK(cs_main);
+            MarkBlockAsReceived(hashBlock);
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+        } else if (!fHavePrev) {
+            LOCK(cs_main);
             if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
@@ -5104,24 +5834,190 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
         } else {
             pfrom->AddInventoryKnown(inv);
 
+            // With headers first the index usually has the header already, only the data is new
+            if (!fHaveData) {
+                ProcessReceivedBlock(pfrom, block, strCommand);
+            } else {
+                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                LOCK(cs_main);
+                MarkBlockAsReceived(hashBlock);
+            }
+        }
+    }
+
+    else if (strCommand == "cmpctblock" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // Fetch the missing headers, the block itself is downloaded once they connect
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+                return true;
+            }
+
+            bool fAhead;
+            if (!CheckPoSHeaderBudget(cmpctblock.header, fAhead))
+                return true;
+
+            CBlockIndex* pindex = NULL;
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock %s", hashBlock.ToString());
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                return true;
+            }
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fInFlightFromPeer = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nChainWork <= chainActive.Tip()->nChainWork) {
+                // Nothing to gain from a block we have or that does not extend our best chain
+                if (fInFlightFromPeer)
+                    MarkBlockAsReceived(hashBlock);
+                return true;
+            }
+            if (itInFlight != mapBlocksInFlight.end() && (!fInFlightFromPeer || itInFlight->second.second->partialBlock))
+                return true;
+
+            std::vector<CInv> vGetData(1, CInv(MSG_BLOCK, hashBlock));
+            std::list<QueuedBlock>::iterator itQueued;
+            MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex, &itQueued);
+            if (pindex->pprev != chainActive.Tip()) {
+                // Our mempool only matches blocks on top of our tip, ask for the whole block
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            // Orphans may have been left out of the mempool and still be in the block
+            std::vector<const CTransaction*> vExtraTxn;
+            vExtraTxn.reserve(mapOrphanTransactions.size());
+            for (const std::pair<const uint256, COrphanTx>& orphan : mapOrphanTransactions)
+                vExtraTxn.push_back(&orphan.second.tx);
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock = std::make_shared<PartiallyDownloadedBlock>(&mempool);
+            ReadStatus status = partialBlock->InitData(cmpctblock, vExtraTxn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hashBlock);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid cmpctblock %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
             }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hashBlock;
+                itQueued->partialBlock = partialBlock;
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            // Every transaction was at hand, no round trip needed
+            status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+            if (status != READ_STATUS_OK) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+            fBlockReconstructed = true;
         }
+
+        if (fBlockReconstructed)
+            ProcessReceivedBlock(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CBlockIndex* pindex = NULL;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !chainActive.Contains(mi->second)) {
+                LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+            pindex = mi->second;
+            if (chainActive.Height() - pindex->nHeight >= MAX_BLOCKTXN_DEPTH) {
+                // Too old to be rebuilt from a mempool, the peer gets the full block
+                LogPrint("net", "peer=%d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+                pindex = NULL;
+            }
+        }
+        if (!pindex) {
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        // Block data never moves once stored, so the disk read does not need cs_main
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() || !itInFlight->second.second->partialBlock) {
+                LogPrint("net", "peer=%d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock = itInFlight->second.second->partialBlock;
+            itInFlight->second.second->partialBlock.reset();
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid blocktxn for block %s from peer=%d", resp.blockhash.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Most likely a short ID collision, fall back to the full block which stays in flight
+                pfrom->PushMessage("getdata", std::vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+                return true;
+            }
+        }
+
+        ProcessReceivedBlock(pfrom, block, strCommand);
     }
 
     // This asymmetric behavior for inbound and outbound connections was introduced
@@ -5130,7 +6026,10 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     // Making users (which are behind NAT and can only make outgoing connections) ignore
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = addrman.GetAddr();
         for (const CAddress& addr : vAddr)
             pfrom->PushAddress(addr);
@@ -5443,7 +6342,12 @@ bool ProcessMessages(CNode* pfrom)
         // Process message
         bool fRet = false;
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsConcurrentMessage(strCommand)) {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                LOCK(cs_serialMessages);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, std::string("error parsing message"));
@@ -5523,9 +6427,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                // Periodically clear addrKnown to allow refresh broadcasts
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrToSend);
+                    pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertiseLocal(pnode);
@@ -5538,11 +6444,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: addr
         //
         if (fSendTrickle) {
+            LOCK(pto->cs_addrToSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -5584,13 +6491,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (IsHeadersFirstPeer(pto)) {
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Resume the headers sync that paused at MAX_POS_HEADERS_AHEAD once the blocks caught up
+        if (state.fHeadersAhead && pindexBestHeader->nHeight < chainActive.Height() + MAX_POS_HEADERS_AHEAD / 2) {
+            state.fHeadersAhead = false;
+            LogPrint("net", "resume getheaders (%d) to peer=%d\n", pindexBestHeader->nHeight, pto->id);
+            pto->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -5608,7 +6525,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             for (const CInv& inv : pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5627,13 +6544,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                pto->filterInventoryKnown.insert(inv);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000) {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -5685,7 +6600,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
+        // AlreadyHave reads state of the serialized handlers; when one is running, ask next round
+        TRY_LOCK(cs_serialMessages, lockSerial);
+        TRY_LOCK(mnodeman.cs_process_message, lockMasternodes);
+        while (lockSerial && lockMasternodes && !pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(inv)) {
                 if (fDebug)
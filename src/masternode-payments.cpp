@@ -387,10 +387,13 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
             nHeight = chainActive.Tip()->nHeight;
         }
 
-        if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
-            LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
-            masternodeSync.AddedMasternodeWinner(winner.GetHash());
-            return;
+        {
+            LOCK(cs_mapMasternodePayeeVotes);
+            if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
+                LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
+                masternodeSync.AddedMasternodeWinner(winner.GetHash());
+                return;
+            }
         }
 
         int nFirstBlock = nHeight - (mnodeman.CountEnabled() * 1.25);
@@ -513,13 +516,55 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[winnerIn.nBlockHeight];
+        blockPayees.AddPayee(winnerIn.payee, 1);
+        if (blockPayees.HasPayeeWithVotes(winnerIn.payee, MNPAYMENTS_LAST_PAID_VOTES))
+            mapPayeeVotedHeights[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+void CMasternodePayments::AddVotedHeights(const CMasternodeBlockPayees& blockPayees)
+{
+    for (const CMasternodePayee& payee : blockPayees.vecPayments) {
+        if (payee.nVotes >= MNPAYMENTS_LAST_PAID_VOTES)
+            mapPayeeVotedHeights[payee.scriptPubKey].insert(blockPayees.nBlockHeight);
+    }
+}
+
+void CMasternodePayments::EraseVotedHeights(int nBlockHeight)
+{
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it == mapMasternodeBlocks.end()) return;
+
+    for (const CMasternodePayee& payee : it->second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator itHeights = mapPayeeVotedHeights.find(payee.scriptPubKey);
+        if (itHeights == mapPayeeVotedHeights.end()) continue;
+        itHeights->second.erase(nBlockHeight);
+        if (itHeights->second.empty())
+            mapPayeeVotedHeights.erase(itHeights);
+    }
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nTipHeight, int nDepth)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPayeeVotedHeights.find(payee);
+    if (it == mapPayeeVotedHeights.end()) return 0;
+
+    // heights above the tip are votes for future blocks
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nTipHeight);
+    if (itHeight == it->second.begin()) return 0;
+    --itHeight;
+
+    if (*itHeight <= 0 || *itHeight <= nTipHeight - nDepth) return 0;
+
+    return *itHeight;
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew, CAmount prevMoneySupply)
 {
     LOCK(cs_vecPayments);
@@ -638,6 +683,7 @@ void CMasternodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
             masternodeSync.mapSeenSyncMNW.erase((*it).first);
             mapMasternodePayeeVotes.erase(it++);
+            EraseVotedHeights(winner.nBlockHeight);
             mapMasternodeBlocks.erase(winner.nBlockHeight);
         } else {
             ++it;
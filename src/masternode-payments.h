@@ -23,6 +23,7 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+#define MNPAYMENTS_LAST_PAID_VOTES 2
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight, int64_t prevMoneySupply);
@@ -233,6 +234,11 @@ class CMasternodePayments
 private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
+    // payee -> heights in mapMasternodeBlocks where it has at least MNPAYMENTS_LAST_PAID_VOTES votes
+    std::map<CScript, std::set<int> > mapPayeeVotedHeights;
+
+    void AddVotedHeights(const CMasternodeBlockPayees& blockPayees);
+    void EraseVotedHeights(int nBlockHeight);
 
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
@@ -250,6 +256,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotedHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -259,6 +266,9 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
+    /// Most recent height of the last nDepth blocks up to nTipHeight where payee has enough votes, 0 if none
+    int GetLastPaidHeight(const CScript& payee, int nTipHeight, int nDepth);
+
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight, CAmount prevMoneySupply);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
@@ -293,6 +303,11 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead()) {
+            mapPayeeVotedHeights.clear();
+            for (const std::pair<const int, CMasternodeBlockPayees>& blockPayees : mapMasternodeBlocks)
+                AddVotedHeights(blockPayees.second);
+        }
     }
 };
 
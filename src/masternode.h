@@ -26,7 +26,6 @@
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern std::map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -108,6 +107,8 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
+    // collateral was found unspent, later spends are reported by CMasternodeMan::SyncTransaction
+    bool fCollateralChecked;
 
 public:
     enum state {
@@ -169,6 +170,7 @@ public:
         swap(first.nLastDsq, second.nLastDsq);
         swap(first.nScanningErrorCount, second.nScanningErrorCount);
         swap(first.nLastScanningErrorBlockHeight, second.nLastScanningErrorBlockHeight);
+        swap(first.fCollateralChecked, second.fCollateralChecked);
     }
 
     CMasternode& operator=(CMasternode from)
@@ -186,6 +188,7 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    uint256 CalculateScore(const uint256& blockHash, const uint256& blockHashHash) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -211,7 +214,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -224,6 +227,9 @@ public:
 
     void Check(bool forceCheck = false);
 
+    /// Probe the coins view for an unspent 10000 COIN collateral, requires cs_main
+    bool IsCollateralUnspent() const;
+
     bool IsBroadcastedWithin(int seconds)
     {
         return (GetAdjustedTime() - sigTime) < seconds;
@@ -261,8 +267,9 @@ public:
 
     std::string GetStatus();
 
-    int64_t GetLastPaid();
-    int64_t GetLastPaidBlock();
+    /// Last payment time and height, nMnCount is the number of enabled masternodes (-1 to count them)
+    int64_t GetLastPaid(int nMnCount = -1);
+    int64_t GetLastPaidBlock(int nMnCount = -1);
     bool IsValidNetAddr();
 };
 
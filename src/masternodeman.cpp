@@ -26,17 +26,9 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const std::pair<int64_t, CTxIn>& t1,
-        const std::pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreMN {
-    bool operator()(const std::pair<int64_t, CMasternode>& t1,
-        const std::pair<int64_t, CMasternode>& t2) const
+struct CompareScoreIndex {
+    bool operator()(const std::pair<int64_t, size_t>& t1,
+        const std::pair<int64_t, size_t>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -209,6 +201,11 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        {
+            LOCK(cs_collaterals);
+            setCollaterals.insert(mn.vin.prevout);
+        }
+        ClearScoreTables();
         return true;
     }
 
@@ -217,6 +214,9 @@ bool CMasternodeMan::Add(CMasternode& mn)
 
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
+    // mnw, mnget and ix handlers ask from several threads at once
+    LOCK(cs);
+
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
     if (i != mWeAskedForMasternodeListEntry.end()) {
         int64_t t = (*i).second;
@@ -235,11 +235,50 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
+    ProcessSpentCollaterals();
+
+    // try cs_main once for the whole list, collateral probes of new entries then lock it recursively
+    TRY_LOCK(cs_main, lockMain);
+
     for (CMasternode& mn : vMasternodes) {
         mn.Check();
     }
 }
 
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    if (tx.IsCoinBase()) return;
+
+    // Runs under cs_main, which other paths take while holding cs: only queue the spends
+    LOCK(cs_collaterals);
+
+    if (setCollaterals.empty()) return;
+
+    for (const CTxIn& txin : tx.vin) {
+        if (!setCollaterals.count(txin.prevout)) continue;
+
+        LogPrint("masternode", "CMasternodeMan::SyncTransaction - collateral %s of Masternode spent by %s\n", txin.prevout.ToStringShort(), tx.GetHash().ToString());
+        vSpentCollaterals.push_back(txin.prevout);
+    }
+}
+
+void CMasternodeMan::ProcessSpentCollaterals()
+{
+    AssertLockHeld(cs);
+
+    std::vector<COutPoint> vSpent;
+    {
+        LOCK(cs_collaterals);
+        vSpent.swap(vSpentCollaterals);
+    }
+
+    for (const COutPoint& outpoint : vSpent) {
+        CMasternode* pmn = Find(CTxIn(outpoint));
+        if (pmn != NULL)
+            pmn->activeState = CMasternode::MASTERNODE_VIN_SPENT;
+    }
+}
+
 void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 {
     Check();
@@ -278,7 +317,12 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
+            {
+                LOCK(cs_collaterals);
+                setCollaterals.erase((*it).vin.prevout);
+            }
             it = vMasternodes.erase(it);
+            ClearScoreTables();
         } else {
             ++it;
         }
@@ -340,14 +384,62 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    {
+        LOCK(cs_collaterals);
+        setCollaterals.clear();
+        vSpentCollaterals.clear();
+    }
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    mapScoreTables.clear();
     nDsqCount = 0;
 }
 
+void CMasternodeMan::ClearScoreTables()
+{
+    LOCK(cs);
+    mapScoreTables.clear();
+}
+
+const CMasternodeScoreTable* CMasternodeMan::GetScoreTable(int64_t nBlockHeight)
+{
+    LOCK(cs);
+
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    std::map<int64_t, CMasternodeScoreTable>::iterator it = mapScoreTables.find(nBlockHeight);
+    if (it != mapScoreTables.end() && it->second.blockHash == hash)
+        return &it->second;
+
+    if (it == mapScoreTables.end() && mapScoreTables.size() >= MASTERNODES_SCORE_TABLES_MAX)
+        mapScoreTables.erase(mapScoreTables.begin()); // lowest height first
+
+    CMasternodeScoreTable& table = mapScoreTables[nBlockHeight];
+    table.blockHash = hash;
+    table.vScores.clear();
+    table.vCompactScores.clear();
+
+    // hash2 of CalculateScore only depends on the block, compute it once for the whole list
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hash;
+    uint256 hash2 = ss.GetHash();
+
+    table.vScores.reserve(vMasternodes.size());
+    table.vCompactScores.reserve(vMasternodes.size());
+    for (const CMasternode& mn : vMasternodes) {
+        uint256 n = mn.CalculateScore(hash, hash2);
+        table.vScores.push_back(n);
+        table.vCompactScores.push_back(n.GetCompact(false));
+    }
+
+    return &table;
+}
+
 int CMasternodeMan::stable_size ()
 {
     int nStable_size = 0;
@@ -475,6 +567,7 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount)
 {
     LOCK(cs);
+    ProcessSpentCollaterals();
 
     CMasternode* pBestMasternode = NULL;
     std::vector<std::pair<int64_t, CTxIn> > vecMasternodeLastPaid;
@@ -500,7 +593,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(std::make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(std::make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -515,17 +608,21 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
     //  -- (chance per block * chances before IsScheduled will fire)
+    const CMasternodeScoreTable* pScores = GetScoreTable(nBlockHeight - 100);
+    if (!pScores) return NULL;
+
     int nTenthNetwork = CountEnabled() / 10;
     int nCountTenth = 0;
     uint256 nHigh = 0;
     for (PAIRTYPE(int64_t, CTxIn) & s : vecMasternodeLastPaid) {
-        CMasternode* pmn = Find(s.second);
-        if (!pmn) break;
+        size_t i = 0;
+        while (i < vMasternodes.size() && vMasternodes[i].vin.prevout != s.second.prevout) i++;
+        if (i == vMasternodes.size()) break;
 
-        uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
+        uint256 n = pScores->vScores[i];
         if (n > nHigh) {
             nHigh = n;
-            pBestMasternode = pmn;
+            pBestMasternode = &vMasternodes[i];
         }
         nCountTenth++;
         if (nCountTenth >= nTenthNetwork) break;
@@ -570,16 +667,20 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     int64_t score = 0;
     CMasternode* winner = NULL;
 
+    LOCK(cs);
+    ProcessSpentCollaterals();
+
+    const CMasternodeScoreTable* pScores = GetScoreTable(nBlockHeight);
+
     // scan for winner
-    for (CMasternode& mn : vMasternodes) {
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CMasternode& mn = vMasternodes[i];
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
-
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+        if (!pScores) continue;
 
         // determine the winner
+        int64_t n2 = pScores->vCompactScores[i];
         if (n2 > score) {
             score = n2;
             winner = &mn;
@@ -591,16 +692,20 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<std::pair<int64_t, CTxIn> > vecMasternodeScores;
+    std::vector<std::pair<int64_t, size_t> > vecMasternodeScores;
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
+    LOCK(cs);
+    ProcessSpentCollaterals();
+
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const CMasternodeScoreTable* pScores = GetScoreTable(nBlockHeight);
+    if (!pScores) return -1;
 
     // scan for winner
-    for (CMasternode& mn : vMasternodes) {
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CMasternode& mn = vMasternodes[i];
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -615,18 +720,16 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(std::make_pair(n2, mn.vin));
+        vecMasternodeScores.push_back(std::make_pair(pScores->vCompactScores[i], i));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreIndex());
 
     int rank = 0;
-    for (PAIRTYPE(int64_t, CTxIn) & s : vecMasternodeScores) {
+    for (PAIRTYPE(int64_t, size_t) & s : vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (vMasternodes[s.second].vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -636,36 +739,37 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<std::pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<std::pair<int64_t, CMasternode> > vecMasternodeScores;
+    std::vector<std::pair<int64_t, size_t> > vecMasternodeScores;
     std::vector<std::pair<int, CMasternode> > vecMasternodeRanks;
 
+    LOCK(cs);
+    ProcessSpentCollaterals();
+
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const CMasternodeScoreTable* pScores = GetScoreTable(nBlockHeight);
+    if (!pScores) return vecMasternodeRanks;
 
     // scan for winner
-    for (CMasternode& mn : vMasternodes) {
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CMasternode& mn = vMasternodes[i];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(std::make_pair(9999, mn));
+            vecMasternodeScores.push_back(std::make_pair(9999, i));
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(std::make_pair(n2, mn));
+        vecMasternodeScores.push_back(std::make_pair(pScores->vCompactScores[i], i));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreIndex());
 
     int rank = 0;
-    for (PAIRTYPE(int64_t, CMasternode) & s : vecMasternodeScores) {
+    for (PAIRTYPE(int64_t, size_t) & s : vecMasternodeScores) {
         rank++;
-        vecMasternodeRanks.push_back(std::make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(std::make_pair(rank, vMasternodes[s.second]));
     }
 
     return vecMasternodeRanks;
@@ -673,35 +777,59 @@ std::vector<std::pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<std::pair<int64_t, CTxIn> > vecMasternodeScores;
+    std::vector<std::pair<int64_t, size_t> > vecMasternodeScores;
+
+    LOCK(cs);
+    ProcessSpentCollaterals();
+
+    // an unknown block scores every masternode 0
+    const CMasternodeScoreTable* pScores = GetScoreTable(nBlockHeight);
 
     // scan for winner
-    for (CMasternode& mn : vMasternodes) {
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CMasternode& mn = vMasternodes[i];
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(std::make_pair(n2, mn.vin));
+        vecMasternodeScores.push_back(std::make_pair(pScores ? pScores->vCompactScores[i] : 0, i));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreIndex());
 
     int rank = 0;
-    for (PAIRTYPE(int64_t, CTxIn) & s : vecMasternodeScores) {
+    for (PAIRTYPE(int64_t, size_t) & s : vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &vMasternodes[s.second];
         }
     }
 
     return NULL;
 }
 
+bool CMasternodeMan::GetHighestScore(int64_t nBlockHeight, CTxIn& vinRet)
+{
+    LOCK(cs);
+
+    const CMasternodeScoreTable* pScores = GetScoreTable(nBlockHeight);
+    if (!pScores) return false;
+
+    uint256 nHigh = 0;
+    bool fFound = false;
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        if (pScores->vScores[i] > nHigh) {
+            nHigh = pScores->vScores[i];
+            vinRet = vMasternodes[i].vin;
+            fFound = true;
+        }
+    }
+
+    return fFound;
+}
+
 void CMasternodeMan::ProcessMasternodeConnections()
 {
     //we don't care about this for regtest
@@ -942,6 +1070,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
                         pmn->addr = addr;
+                        ClearScoreTables();
                         //fake ping
                         pmn->lastPing = CMasternodePing(vin);
                     }
@@ -1135,7 +1264,12 @@ void CMasternodeMan::Remove(CTxIn vin)
     while (it != vMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
+            {
+                LOCK(cs_collaterals);
+                setCollaterals.erase((*it).vin.prevout);
+            }
             vMasternodes.erase(it);
+            ClearScoreTables();
             break;
         }
         ++it;
@@ -13,9 +13,11 @@
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_TABLES_MAX 64
 
 class CMasternodeMan;
 
@@ -46,15 +48,24 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
-class CMasternodeMan
+/** Election scores of the masternode list for one block
+ */
+class CMasternodeScoreTable
+{
+public:
+    uint256 blockHash;
+    // scores by position of the masternode in CMasternodeMan::vMasternodes
+    std::vector<uint256> vScores;
+    // GetCompact(false) of vScores, which the rankings sort by
+    std::vector<int64_t> vCompactScores;
+};
+
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    // critical section to protect the inner data structures specifically on messaging
-    mutable CCriticalSection cs_process_message;
-
     // map to hold all MNs
     std::vector<CMasternode> vMasternodes;
     // who's asked for the Masternode list and the last time
@@ -63,8 +74,27 @@ private:
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // guards setCollaterals and vSpentCollaterals. Taken after cs, or alone by SyncTransaction,
+    // which runs under cs_main and so must not take cs
+    mutable CCriticalSection cs_collaterals;
+    // collateral outpoints of vMasternodes, spends are watched in SyncTransaction
+    std::set<COutPoint> setCollaterals;
+    // collaterals spent since they were last applied to vMasternodes
+    std::vector<COutPoint> vSpentCollaterals;
+    // score tables by block height, valid until the list or the tip changes
+    std::map<int64_t, CMasternodeScoreTable> mapScoreTables;
+
+    /// Mark the masternodes of the queued collateral spends VIN_SPENT, requires cs
+    void ProcessSpentCollaterals();
+
+    /// Get (and build if needed) the score table for this block, NULL if the block is unknown
+    const CMasternodeScoreTable* GetScoreTable(int64_t nBlockHeight);
 
 public:
+    // critical section to protect the inner data structures specifically on messaging,
+    // also guards the seen maps below for the other message handler threads
+    mutable CCriticalSection cs_process_message;
+
     // Keep track of all broadcasts I've seen
     std::map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
     // Keep track of all pings I've seen
@@ -80,6 +110,13 @@ public:
     {
         LOCK(cs);
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            LOCK(cs_collaterals);
+            setCollaterals.clear();
+            for (const CMasternode& mn : vMasternodes)
+                setCollaterals.insert(mn.vin.prevout);
+            mapScoreTables.clear();
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -101,12 +138,18 @@ public:
     /// Check all Masternodes
     void Check();
 
+    /// Queue the spends of masternode collaterals by this transaction
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
     /// Check all Masternodes and remove inactive
     void CheckAndRemove(bool forceExpiredRemoval = false);
 
     /// Clear Masternode vector
     void Clear();
 
+    /// Drop all cached score tables, must be called whenever vMasternodes or the chain tip changes
+    void ClearScoreTables();
+
     int CountEnabled(int protocolVersion = -1);
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
@@ -136,6 +179,8 @@ public:
     std::vector<std::pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
+    /// Get the masternode with the highest full score for this block, whatever its state
+    bool GetHighestScore(int64_t nBlockHeight, CTxIn& vinRet);
 
     void ProcessMasternodeConnections();
 
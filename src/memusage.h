@@ -0,0 +1,89 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <assert.h>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/**
+ * Estimates of the heap memory used by containers, for caches that are
+ * limited in bytes rather than in number of elements. The estimates count
+ * the allocations a container makes, not sizeof the container itself.
+ */
+namespace memusage
+{
+/** Bytes a malloc of the given size really takes, including glibc's chunk header and alignment. */
+static inline size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    assert(sizeof(void*) == 4);
+    return ((alloc + 15) >> 3) << 3;
+}
+
+// Node layouts of the standard and boost containers, only used for their size
+
+//! Red-black tree node: colour, parent, left and right
+struct stl_tree_node_base {
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+};
+
+template <typename X>
+struct stl_tree_node : private stl_tree_node_base {
+    X x;
+};
+
+//! boost::unordered node: the value, the next pointer and the cached hash
+template <typename X>
+struct unordered_node : private X {
+    void* ptr;
+    size_t hash;
+};
+
+template <typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template <typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+template <typename X, typename Y>
+static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>));
+}
+
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+} // namespace memusage
+
+#endif // BITCOIN_MEMUSAGE_H
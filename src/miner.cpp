@@ -30,61 +30,32 @@
 
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // NBXMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+// Sorts the transactions of a package so that parents come before their
+// children: a child has every ancestor of its parent, and the parent too.
+class CompareTxIterByAncestorCount
 {
 public:
-    const CTransaction* ptx;
-    std::set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
     }
 };
 
+/** Packages in a row that do not fit a nearly full block before CreateNewBlock stops looking */
+static const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
-
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
-    }
-};
-
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
@@ -166,8 +137,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
     nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
 
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
+    // How much of the block may be filled with transactions paying less than
+    // the relay fee
     unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
@@ -181,178 +152,127 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
     {
         LOCK2(cs_main, mempool.cs);
+        int64_t nTimeStart = GetTimeMicros();
 
         CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        std::list<COrphan> vOrphan; // list memory doesn't move
-        std::map<uint256, std::vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        std::vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (std::map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
+        // Collect transactions into block
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
+        unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+
+        // Transactions paying less than the relay fee only fill the space
+        // set aside for them, or the minimum block size
+        unsigned int nBlockFreeSize = std::max(nBlockPrioritySize, nBlockMinSize);
+
+        // Walk the mempool once, best ancestor package score first. Each
+        // transaction is taken together with the ancestors not yet in the
+        // block, parents first. Scores of packages whose ancestors were taken
+        // earlier are not recomputed; at worst they are reached later than ideal.
+        CTxMemPool::setEntries inBlock;
+        CTxMemPool::setEntries failedTx;
+        int nPackagesSelected = 0;
+        int64_t nConsecutiveFailed = 0;
+        CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+        for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi) {
+            CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+            if (inBlock.count(iter) || failedTx.count(iter))
                 continue;
-            }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
+            // The cached ancestor state is the package while none of it is in the
+            // block. Otherwise the ancestors are collected, at most
+            // -limitancestorcount of them as mempool acceptance enforces.
+            std::vector<CTxMemPool::txiter> vPackage;
+            uint64_t nPackageSize = iter->GetSizeWithAncestors();
+            CAmount nPackageFees = iter->GetModFeesWithAncestors();
+            if (iter->GetCountWithAncestors() > 1) {
+                CTxMemPool::setEntries setAncestors;
+                mempool.CalculateMemPoolAncestors(*iter, setAncestors, false);
+                bool fAncestorFailed = false;
+                for (CTxMemPool::txiter ancestorIt : setAncestors) {
+                    if (failedTx.count(ancestorIt)) {
+                        fAncestorFailed = true;
                         break;
                     }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
+                    if (inBlock.count(ancestorIt)) {
+                        nPackageSize -= ancestorIt->GetTxSize();
+                        nPackageFees -= ancestorIt->GetModifiedFee();
+                        continue;
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                    vPackage.push_back(ancestorIt);
+                }
+                if (fAncestorFailed) {
+                    failedTx.insert(iter);
                     continue;
                 }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                // spends can have very large priority, use non-overflowing safe functions
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
+            vPackage.push_back(iter);
 
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            // Size limits. Once the block is nearly full, give up after a run of
+            // packages that do not fit instead of walking the whole pool.
+            if (nBlockSize + nPackageSize >= nBlockMaxSize) {
+                if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 4000)
+                    break;
                 continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
             }
 
-            if (!view.HaveInputs(tx))
+            // Skip free transactions once the space for them is used up
+            CFeeRate packageFeeRate(nPackageFees, nPackageSize);
+            if (packageFeeRate < ::minRelayTxFee && nBlockSize + nPackageSize >= nBlockFreeSize)
                 continue;
 
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+            std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+            for (CTxMemPool::txiter it : vPackage) {
+                const CTransaction& tx = it->GetTx();
+                if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight) || !view.HaveInputs(tx)) {
+                    failedTx.insert(it);
+                    break;
+                }
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
+                // Legacy limits on sigOps:
+                unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+                if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
+                    break;
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
+                CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
 
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
+                // Note that flags: we don't want to set mempool/IsStandard()
+                // policy here, but we still have to ensure that the block we
+                // create only contains transactions that are valid in new blocks.
 
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+                CValidationState state;
+                if (!CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, true, true)) {
+                    failedTx.insert(it);
+                    break;
+                }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                for (COrphan* porphan : mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                CTxUndo txundo;
+                UpdateCoins(tx, state, view, txundo, nHeight);
+
+                // Added
+                unsigned int nTxSize = it->GetTxSize();
+                pblock->vtx.push_back(tx);
+                pblocktemplate->vTxFees.push_back(nTxFees);
+                pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+                nBlockSize += nTxSize;
+                ++nBlockTx;
+                nBlockSigOps += nTxSigOps;
+                nFees += nTxFees;
+                inBlock.insert(it);
+
+                if (fPrintPriority) {
+                    LogPrintf("priority %.1f fee %s txid %s\n",
+                        it->GetPriority(nHeight), CFeeRate(it->GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
                 }
             }
+            if (inBlock.count(iter)) {
+                nPackagesSelected++;
+                nConsecutiveFailed = 0;
+            }
         }
+        int64_t nTimePackages = GetTimeMicros();
 
         if (!fProofOfStake) {
             //Make payee
@@ -401,6 +321,10 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             mempool.clear();
             return NULL;
         }
+        int64_t nTimeValidity = GetTimeMicros();
+        LogPrint("bench", "CreateNewBlock() packages: %.2fms (%d packages, %u txs), validity: %.2fms (total %.2fms)\n",
+            0.001 * (nTimePackages - nTimeStart), nPackagesSelected, (unsigned int)nBlockTx,
+            0.001 * (nTimeValidity - nTimePackages), 0.001 * (nTimeValidity - nTimeStart));
     }
 
     return pblocktemplate.release();
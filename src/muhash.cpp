@@ -0,0 +1,180 @@
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <ios>
+#include <stdexcept>
+#include <string.h>
+
+namespace
+{
+/** The prime modulus and its Montgomery context, shared read-only by all instances */
+class CMuHashModulus
+{
+public:
+    BIGNUM* p;
+    BN_MONT_CTX* mont;
+    //! 1 in Montgomery form, the hash of the empty set
+    BIGNUM* one;
+
+    CMuHashModulus()
+    {
+        BN_CTX* ctx = BN_CTX_new();
+        p = BN_new();
+        mont = BN_MONT_CTX_new();
+        one = BN_new();
+        if (!ctx || !p || !mont || !one || !BN_set_bit(p, 3072) || !BN_sub_word(p, 1103717) ||
+            !BN_MONT_CTX_set(mont, p, ctx) || !BN_to_montgomery(one, BN_value_one(), mont, ctx))
+            throw std::runtime_error("CMuHashModulus : OpenSSL initialization failed");
+        BN_CTX_free(ctx);
+    }
+};
+
+const CMuHashModulus& Modulus()
+{
+    static const CMuHashModulus modulus;
+    return modulus;
+}
+
+/** A BN_CTX for the duration of one operation */
+class CBNContext
+{
+public:
+    BN_CTX* ctx;
+
+    CBNContext() : ctx(BN_CTX_new())
+    {
+        if (!ctx)
+            throw std::runtime_error("CBNContext : BN_CTX_new failed");
+    }
+    ~CBNContext() { BN_CTX_free(ctx); }
+
+    operator BN_CTX*() { return ctx; }
+};
+
+void WriteBytes(const BIGNUM* bn, unsigned char* vch)
+{
+    // BN_bn2bin writes no leading zeros
+    size_t nSize = BN_num_bytes(bn);
+    memset(vch, 0, CMuHash3072::BYTE_SIZE - nSize);
+    BN_bn2bin(bn, vch + CMuHash3072::BYTE_SIZE - nSize);
+}
+
+void ReadBytes(BIGNUM* bn, const unsigned char* vch)
+{
+    BN_bin2bn(vch, CMuHash3072::BYTE_SIZE, bn);
+    if (BN_is_zero(bn) || BN_cmp(bn, Modulus().p) >= 0)
+        throw std::ios_base::failure("MuHash state out of range");
+}
+}
+
+CMuHash3072::CMuHash3072() : numerator(BN_dup(Modulus().one)), denominator(BN_dup(Modulus().one))
+{
+    if (!numerator || !denominator)
+        throw std::runtime_error("CMuHash3072 : BN_dup failed");
+}
+
+CMuHash3072::CMuHash3072(const CMuHash3072& other) : numerator(BN_dup(other.numerator)), denominator(BN_dup(other.denominator))
+{
+    if (!numerator || !denominator)
+        throw std::runtime_error("CMuHash3072 : BN_dup failed");
+}
+
+CMuHash3072& CMuHash3072::operator=(const CMuHash3072& other)
+{
+    if (!BN_copy(numerator, other.numerator) || !BN_copy(denominator, other.denominator))
+        throw std::runtime_error("CMuHash3072 : BN_copy failed");
+    return *this;
+}
+
+CMuHash3072::~CMuHash3072()
+{
+    BN_clear_free(numerator);
+    BN_clear_free(denominator);
+}
+
+void CMuHash3072::Multiply(BIGNUM* product, const unsigned char* data, size_t len)
+{
+    // Expand the element to 3072 bits, SHA512 in counter mode over its SHA256
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(hash);
+    unsigned char vch[BYTE_SIZE];
+    for (unsigned char i = 0; i < BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(hash, sizeof(hash)).Write(&i, 1).Finalize(vch + i * CSHA512::OUTPUT_SIZE);
+
+    const CMuHashModulus& modulus = Modulus();
+    CBNContext ctx;
+    BN_CTX_start(ctx);
+    BIGNUM* x = BN_CTX_get(ctx);
+    bool fOk = x && BN_bin2bn(vch, BYTE_SIZE, x);
+    // Reduce the rare values past the modulus, and keep the element invertible
+    if (fOk && BN_cmp(x, modulus.p) >= 0)
+        fOk = BN_sub(x, x, modulus.p);
+    if (fOk && BN_is_zero(x))
+        fOk = BN_one(x);
+    // The element is taken as a number in Montgomery form, so one multiplication is enough
+    fOk = fOk && BN_mod_mul_montgomery(product, product, x, modulus.mont, ctx);
+    BN_CTX_end(ctx);
+    if (!fOk)
+        throw std::runtime_error("CMuHash3072 : OpenSSL multiplication failed");
+}
+
+void CMuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    Multiply(numerator, data, len);
+}
+
+void CMuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    Multiply(denominator, data, len);
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& other)
+{
+    const CMuHashModulus& modulus = Modulus();
+    CBNContext ctx;
+    if (!BN_mod_mul_montgomery(numerator, numerator, other.numerator, modulus.mont, ctx) ||
+        !BN_mod_mul_montgomery(denominator, denominator, other.denominator, modulus.mont, ctx))
+        throw std::runtime_error("CMuHash3072 : OpenSSL multiplication failed");
+    return *this;
+}
+
+uint256 CMuHash3072::Finalize() const
+{
+    const CMuHashModulus& modulus = Modulus();
+    CBNContext ctx;
+    BN_CTX_start(ctx);
+    BIGNUM* num = BN_CTX_get(ctx);
+    BIGNUM* den = BN_CTX_get(ctx);
+    bool fOk = den && BN_from_montgomery(num, numerator, modulus.mont, ctx) &&
+               BN_from_montgomery(den, denominator, modulus.mont, ctx) &&
+               BN_mod_inverse(den, den, modulus.p, ctx) &&
+               BN_mod_mul(num, num, den, modulus.p, ctx);
+    unsigned char vch[BYTE_SIZE];
+    if (fOk)
+        WriteBytes(num, vch);
+    BN_CTX_end(ctx);
+    if (!fOk)
+        throw std::runtime_error("CMuHash3072 : OpenSSL division failed");
+
+    uint256 hash;
+    CSHA256().Write(vch, sizeof(vch)).Finalize(hash.begin());
+    return hash;
+}
+
+void CMuHash3072::ToBytes(unsigned char* vch) const
+{
+    WriteBytes(numerator, vch);
+    WriteBytes(denominator, vch + BYTE_SIZE);
+}
+
+void CMuHash3072::FromBytes(const unsigned char* vch)
+{
+    ReadBytes(numerator, vch);
+    ReadBytes(denominator, vch + BYTE_SIZE);
+}
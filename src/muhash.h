@@ -0,0 +1,75 @@
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <openssl/bn.h>
+
+/**
+ * A hash of a multiset of byte strings that can be updated in constant time
+ * as elements are added or removed, in any order (MuHash). Each element is
+ * expanded to a number modulo the prime 2^3072 - 1103717, and the set hash
+ * is the product of the elements added divided by the product of the
+ * elements removed. Removals are kept in a separate denominator so that no
+ * modular inverse is needed until Finalize.
+ */
+class CMuHash3072
+{
+public:
+    static const size_t BYTE_SIZE = 384;
+
+private:
+    //! Products of the added and the removed elements, in Montgomery form
+    BIGNUM* numerator;
+    BIGNUM* denominator;
+
+    void Multiply(BIGNUM* product, const unsigned char* data, size_t len);
+
+public:
+    //! The hash of the empty set
+    CMuHash3072();
+    CMuHash3072(const CMuHash3072& other);
+    CMuHash3072& operator=(const CMuHash3072& other);
+    ~CMuHash3072();
+
+    void Insert(const unsigned char* data, size_t len);
+    void Remove(const unsigned char* data, size_t len);
+
+    //! Add all elements of another set, and remove those it removes
+    CMuHash3072& operator*=(const CMuHash3072& other);
+
+    //! The 256-bit hash of the set, independent of the order of updates
+    uint256 Finalize() const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 2 * BYTE_SIZE;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char vch[2 * BYTE_SIZE];
+        ToBytes(vch);
+        s.write((const char*)vch, sizeof(vch));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char vch[2 * BYTE_SIZE];
+        s.read((char*)vch, sizeof(vch));
+        FromBytes(vch);
+    }
+
+    //! Numerator and denominator as 2 * BYTE_SIZE big endian bytes
+    void ToBytes(unsigned char* vch) const;
+    void FromBytes(const unsigned char* vch);
+};
+
+#endif // BITCOIN_MUHASH_H
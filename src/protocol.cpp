@@ -28,7 +28,8 @@ static const char* ppszTypeName[] =
         "mn winner",
         "mn scan error",
         "mn announce",
-        "mn ping"
+        "mn ping",
+        "compact block"
     };
 
 CMessageHeader::CMessageHeader()
@@ -134,7 +135,7 @@ bool CInv::IsKnownType() const
 }
 
 bool CInv::IsMasterNodeType() const{
- 	return (type >= 6);
+ 	return (type >= MSG_SPORK && type <= MSG_MASTERNODE_PING);
 }
 
 const char* CInv::GetCommand() const
@@ -230,7 +230,7 @@ UniValue dAppToJson(const uint256 &txid, const DAppExt &dApp, bool hide = false)
     entry.push_back(Pair("blockchain", dApp.blockchain));
     if (!hide) {
         entry.push_back(Pair("description", dApp.description));
-        entry.push_back(Pair("image", dApp.image));
+        entry.push_back(Pair("image", pdAppStore->GetImage(txid)));
     } else {
         UniValue updates(UniValue::VARR);
         for (auto tx : dApp.updateTxs) {
@@ -383,7 +383,7 @@ UniValue dappupdate(const UniValue &params, bool fHelp) {
         dAppData.push_back(Pair("descr", newDApp.description));
         changed = true;
     }
-    if (newDApp.image != dApp->image) {
+    if (newDApp.image != pdAppStore->GetImage(txid)) {
         dAppData.push_back(Pair("img", newDApp.image));
         changed = true;
     }
@@ -91,6 +91,7 @@ UniValue listmasternodes(const UniValue& params, bool fHelp)
         nHeight = pindex->nHeight;
     }
     std::vector<std::pair<int, CMasternode> > vMasternodeRanks = mnodeman.GetMasternodeRanks(nHeight);
+    int nMnCount = mnodeman.CountEnabled();
     for (PAIRTYPE(int, CMasternode) & s : vMasternodeRanks) {
         UniValue obj(UniValue::VOBJ);
         std::string strVin = s.second.vin.prevout.ToStringShort();
@@ -125,8 +126,8 @@ UniValue listmasternodes(const UniValue& params, bool fHelp)
             obj.push_back(Pair("version", mn->protocolVersion));
             obj.push_back(Pair("lastseen", (int64_t)mn->lastPing.sigTime));
             obj.push_back(Pair("activetime", (int64_t)(mn->lastPing.sigTime - mn->sigTime)));
-            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid()));
-            obj.push_back(Pair("lastpaidblock", (int64_t)mn->GetLastPaidBlock()));
+            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid(nMnCount)));
+            obj.push_back(Pair("lastpaidblock", (int64_t)mn->GetLastPaidBlock(nMnCount)));
 			obj.push_back(Pair("netaddr", mn->addr.ToString()));
 
             ret.push_back(obj);
@@ -730,19 +731,10 @@ UniValue getmasternodescores (const UniValue& params, bool fHelp)
     }
     UniValue obj(UniValue::VOBJ);
 
-    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
     for (int nHeight = chainActive.Tip()->nHeight - nLast; nHeight < chainActive.Tip()->nHeight + 20; nHeight++) {
-        uint256 nHigh = 0;
-        CMasternode* pBestMasternode = NULL;
-        for (CMasternode& mn : vMasternodes) {
-            uint256 n = mn.CalculateScore(1, nHeight - 100);
-            if (n > nHigh) {
-                nHigh = n;
-                pBestMasternode = &mn;
-            }
-        }
-        if (pBestMasternode)
-            obj.push_back(Pair(strprintf("%d", nHeight), pBestMasternode->vin.prevout.hash.ToString().c_str()));
+        CTxIn vinBest;
+        if (mnodeman.GetHighestScore(nHeight - 100, vinBest))
+            obj.push_back(Pair(strprintf("%d", nHeight), vinBest.prevout.hash.ToString().c_str()));
     }
 
     return obj;
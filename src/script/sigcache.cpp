@@ -5,16 +5,20 @@
 
 #include "sigcache.h"
 
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 namespace {
 
+/** Independently locked parts of the cache, so inserts from different script check threads rarely contend. */
+static const unsigned int SIGCACHE_STRIPES = 16;
+
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
@@ -23,66 +27,91 @@ namespace {
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct Stripe {
+        boost::shared_mutex cs_sigcache;
+        CuckooCache::cache<uint256, SignatureCacheHasher> setValid;
+    };
+
+    //! Salted hasher for entries, so that nobody can predict which ones collide
+    CSHA256 saltedHasher;
+    Stripe stripes[SIGCACHE_STRIPES];
+
+    Stripe& GetStripe(const uint256& entry)
+    {
+        return stripes[*entry.begin() % SIGCACHE_STRIPES];
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 nonce = GetRandHash();
+        // Pad the 32 byte nonce to a full 64 byte block, so that only the entry itself is left to hash
+        static const unsigned char PADDING[32] = {0};
+        saltedHasher.Write(nonce.begin(), 32);
+        saltedHasher.Write(PADDING, 32);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey)
+    {
+        CSHA256(saltedHasher).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size()).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    //! Size the cache to about nBytes, returning the number of entries it holds
+    size_t Setup(size_t nBytes)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::set<sigdata_type>::iterator it = setValid.lower_bound(sigdata_type(randomHash));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        size_t nEntries = 0;
+        for (Stripe& stripe : stripes) {
+            boost::unique_lock<boost::shared_mutex> lock(stripe.cs_sigcache);
+            nEntries += stripe.setValid.setup_bytes(nBytes / SIGCACHE_STRIPES);
         }
+        return nEntries;
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        Stripe& stripe = GetStripe(entry);
+        boost::shared_lock<boost::shared_mutex> lock(stripe.cs_sigcache);
+        return stripe.setValid.contains(entry, fErase);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void Set(const uint256& entry)
+    {
+        Stripe& stripe = GetStripe(entry);
+        boost::unique_lock<boost::shared_mutex> lock(stripe.cs_sigcache);
+        stripe.setValid.insert(entry);
     }
 };
 
+CSignatureCache signatureCache;
+
+}
+
+size_t GetSignatureCacheBytes()
+{
+    return std::min(std::max(GetArg("-sigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), MAX_MAX_SIG_CACHE_SIZE) * ((size_t)1 << 20) / 2;
+}
+
+void InitSignatureCache()
+{
+    size_t nMaxCacheSize = GetSignatureCacheBytes();
+    size_t nEntries = signatureCache.Setup(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for signature cache, able to store %zu elements\n",
+        (nEntries * sizeof(uint256)) >> 20, nMaxCacheSize >> 20, nEntries);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures checked while connecting a block will not be needed again
+    if (signatureCache.Get(entry, !store))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
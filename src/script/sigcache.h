@@ -8,10 +8,27 @@
 
 #include "script/interpreter.h"
 
+#include <string.h>
 #include <vector>
 
 class CPubKey;
 
+/** Default and maximum -sigcachemb, in MiB, shared with the script execution cache */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+
+/** Reads the eight 32 bit words of a cache entry, which is already a salted hash. */
+class SignatureCacheHasher
+{
+public:
+    uint32_t operator()(const uint256& key, uint8_t n) const
+    {
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * n, 4);
+        return u;
+    }
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -23,4 +40,9 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Bytes of -sigcachemb that go to each of the signature and script execution caches */
+size_t GetSignatureCacheBytes();
+/** Size the signature cache according to -sigcachemb */
+void InitSignatureCache();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
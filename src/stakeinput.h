@@ -49,6 +49,14 @@ public:
     CNbxStake(){}
 
     bool SetInput(CTransaction txPrev, unsigned int n);
+    // Seed the lookups GetIndexFrom/GetModifier would otherwise do
+    void SetIndexFrom(CBlockIndex* pindex) { pindexFrom = pindex; }
+    void SetModifier(uint64_t nStakeModifierIn, int nStakeModifierHeightIn, int64_t nStakeModifierTimeIn)
+    {
+        nStakeModifier = nStakeModifierIn;
+        nStakeModifierHeight = nStakeModifierHeightIn;
+        nStakeModifierTime = nStakeModifierTimeIn;
+    }
 
     CBlockIndex* GetIndexFrom() override;
     bool GetTxFrom(CTransaction& tx) override;
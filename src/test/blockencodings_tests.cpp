@@ -0,0 +1,131 @@
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+#include "test/test_nbx.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(4);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    // Spends of made up outputs, only their hashes matter here
+    for (int i = 1; i < 4; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        block.vtx[i] = tx;
+    }
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs result;
+    stream >> result;
+    return result;
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0, 0));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, std::vector<const CTransaction*>()) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+
+    // The wrong transactions fail the merkle root check
+    PartiallyDownloadedBlock partialBlockWrong(&pool);
+    BOOST_CHECK(partialBlockWrong.InitData(cmpctblock, std::vector<const CTransaction*>()) == READ_STATUS_OK);
+    CBlock blockWrong;
+    std::vector<CTransaction> vtxWrong;
+    vtxWrong.push_back(block.vtx[3]);
+    vtxWrong.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlockWrong.FillBlock(blockWrong, vtxWrong) == READ_STATUS_FAILED);
+
+    // Too few or too many transactions are invalid
+    PartiallyDownloadedBlock partialBlockShort(&pool);
+    BOOST_CHECK(partialBlockShort.InitData(cmpctblock, std::vector<const CTransaction*>()) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlockShort.FillBlock(blockWrong, std::vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_INVALID);
+
+    CBlock blockRebuilt;
+    std::vector<CTransaction> vtxMissing;
+    vtxMissing.push_back(block.vtx[1]);
+    vtxMissing.push_back(block.vtx[3]);
+    BOOST_CHECK(partialBlock.FillBlock(blockRebuilt, vtxMissing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRebuilt.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(blockRebuilt.BuildMerkleTree().ToString(), block.hashMerkleRoot.ToString());
+}
+
+BOOST_AUTO_TEST_CASE(ExtraTransactionsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0, 0));
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0, 0));
+
+    // The last transaction is only known as an orphan
+    std::vector<const CTransaction*> vExtraTxn(1, &block.vtx[3]);
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, vExtraTxn) == READ_STATUS_OK);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock blockRebuilt;
+    BOOST_CHECK(partialBlock.FillBlock(blockRebuilt, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRebuilt.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.push_back(0);
+    req1.indexes.push_back(1);
+    req1.indexes.push_back(3);
+    req1.indexes.push_back(4);
+    req1.indexes.push_back(65535);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK(req1.indexes == req2.indexes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 #include "base58.h"
 #include "clientversion.h"
 #include "key.h"
+#include "random.h"
 #include "merkleblock.h"
 #include "serialize.h"
 #include "streams.h"
@@ -458,4 +459,51 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter rb(100, 0.01);
+
+    // Overfill, the last 100 elements are always remembered
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 399; i++) {
+        vHashes.push_back(GetRandHash());
+        rb.insert(vHashes.back());
+    }
+    for (int i = 299; i < 399; i++)
+        BOOST_CHECK(rb.contains(vHashes[i]));
+
+    // The oldest generation was dropped
+    unsigned int nOld = 0;
+    for (int i = 0; i < 100; i++)
+        nOld += rb.contains(vHashes[i]);
+    BOOST_CHECK(nOld < 25);
+
+    // Worst case fill, about 100 false positives expected in 10000
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+        nHits += rb.contains(GetRandHash());
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 200);
+
+    CInv inv(MSG_TX, vHashes[0]);
+    rb.insert(inv);
+    BOOST_CHECK(rb.contains(inv));
+
+    std::vector<unsigned char> vKey = ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8");
+    rb.insert(vKey);
+    BOOST_CHECK(rb.contains(vKey));
+
+    rb.reset();
+    BOOST_CHECK(!rb.contains(inv));
+    BOOST_CHECK(!rb.contains(vKey));
+    BOOST_CHECK(!rb.contains(vHashes[398]));
+
+    // Inventory of the same hash and another type is a different element. Checked on
+    // a filter holding one element, where a false positive is practically impossible.
+    rb.insert(inv);
+    BOOST_CHECK(rb.contains(inv));
+    BOOST_CHECK(!rb.contains(CInv(MSG_TXLOCK_REQUEST, vHashes[0])));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
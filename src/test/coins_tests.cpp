@@ -4,7 +4,9 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
 #include "test/test_nbx.h"
 
 #include <vector>
@@ -42,7 +44,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             map_[it->first] = it->second.coins;
@@ -50,14 +52,42 @@ public:
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
-            mapCoins.erase(it++);
+            if (fErase)
+                mapCoins.erase(it++);
+            else
+                ++it;
         }
-        mapCoins.clear();
         hashBestBlock_ = hashBlock;
         return true;
     }
 
-    bool GetStats(CCoinsStats& stats) const { return false; }
+    bool GetStats(CCoinsStats& stats, bool fFullScan) const { return false; }
+};
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+            ret += it->second.coins.DynamicMemoryUsage();
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+
+    bool HaveCoinsInCache(const uint256& txid) const { return cacheCoins.count(txid) > 0; }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacyCoins(const uint256& txid, const CCoins& coins) { db.Write(std::make_pair('c', txid), coins); }
+    bool HaveLegacyCoins(const uint256& txid) const { return db.Exists(std::make_pair('c', txid)); }
 };
 }
 
@@ -84,14 +114,16 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool synced_a_cache = false;
+    bool trimmed_a_cache = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -116,6 +148,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -136,6 +169,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            for (const CCoinsViewCacheTest* test : stack)
+                test->SelfTest();
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -144,6 +179,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 stack.back()->Flush();
                 delete stack.back();
                 stack.pop_back();
+            } else if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                // Write the modifications down without emptying the cache, sometimes dropping the clean entries
+                stack.back()->Sync();
+                synced_a_cache = true;
+                if (insecure_rand() % 2 == 0) {
+                    stack.back()->Trim(0);
+                    trimmed_a_cache = true;
+                }
+                stack.back()->SelfTest();
             }
             if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
                 CCoinsView* tip = &base;
@@ -152,7 +196,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -174,6 +218,180 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(synced_a_cache);
+    BOOST_CHECK(trimmed_a_cache);
+}
+
+// Coins read ahead from the base view never replace what the cache already has,
+// and are not written back on flush.
+BOOST_AUTO_TEST_CASE(coins_prefetch_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache parent(&base);
+    CCoinsViewCache cache(&parent);
+    uint256 txidCached = GetRandHash();
+    uint256 txidPrefetched = GetRandHash();
+
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidCached);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 7;
+    }
+
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 5;
+    CCoins coinsCopy = coins;
+    cache.PrefetchCoins(txidCached, coins);
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidCached)->vout[0].nValue, 7);
+
+    cache.PrefetchCoins(txidPrefetched, coinsCopy);
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidPrefetched)->vout[0].nValue, 5);
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(parent.HaveCoins(txidCached));
+    BOOST_CHECK(!parent.HaveCoins(txidPrefetched));
+}
+
+// Sync writes the modified entries down but keeps them in the cache, and Trim
+// only ever drops entries the base has, the oldest ones first.
+BOOST_AUTO_TEST_CASE(coins_sync_trim_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    std::vector<uint256> txids;
+    size_t nUsage = cache.DynamicMemoryUsage();
+    for (int i = 0; i < 4; i++) {
+        txids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(txids.back());
+        coins->nHeight = i;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i + 1;
+        coins->vout[0].scriptPubKey.assign(25, 0);
+    }
+    BOOST_CHECK(cache.DynamicMemoryUsage() > nUsage);
+    cache.SelfTest();
+
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 4U);
+    CCoins coins;
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(base.GetCoins(txids[i], coins) && coins.vout[0].nValue == i + 1);
+
+    // Spending a synced entry writes the spend down and drops it on the next sync
+    cache.ModifyCoins(txids[0])->Spend(0);
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 3U);
+    BOOST_CHECK(!base.GetCoins(txids[0], coins) || coins.IsPruned());
+
+    // A modified entry is kept by Trim until it has been written
+    cache.ModifyCoins(txids[1])->vout[0].nValue = 10;
+    nUsage = cache.DynamicMemoryUsage();
+    cache.Trim(nUsage - 1);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(cache.HaveCoinsInCache(txids[1]));
+    BOOST_CHECK(cache.HaveCoinsInCache(txids[3]));
+
+    cache.Trim(0);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(base.GetCoins(txids[1], coins) && coins.vout[0].nValue == 10);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    cache.SelfTest();
+}
+
+// The per-transaction records of older versions are converted to per-output
+// records, and writes only touch the outputs that changed.
+BOOST_FIXTURE_TEST_CASE(coins_db_test, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    uint256 txidMany = GetRandHash();
+    uint256 txidOne = GetRandHash();
+    CCoins coinsMany;
+    coinsMany.nVersion = 1;
+    coinsMany.nHeight = 100;
+    coinsMany.fCoinStake = true;
+    coinsMany.vout.resize(300);
+    for (int i = 0; i < 300; i++) {
+        if (i % 3 != 0) {
+            coinsMany.vout[i].nValue = i;
+            coinsMany.vout[i].scriptPubKey = CScript() << i;
+        }
+    }
+    CCoins coinsOne;
+    coinsOne.nVersion = 2;
+    coinsOne.nHeight = 5;
+    coinsOne.fCoinBase = true;
+    coinsOne.vout.resize(1);
+    coinsOne.vout[0].nValue = 50;
+    coinsOne.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    db.WriteLegacyCoins(txidMany, coinsMany);
+    db.WriteLegacyCoins(txidOne, coinsOne);
+
+    CCoins coins;
+    BOOST_CHECK(!db.GetCoins(txidMany, coins));
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(!db.HaveLegacyCoins(txidMany) && !db.HaveLegacyCoins(txidOne));
+    BOOST_CHECK(db.GetCoins(txidMany, coins) && coins == coinsMany);
+    BOOST_CHECK(db.GetCoins(txidOne, coins) && coins == coinsOne);
+    BOOST_CHECK(db.HaveCoins(txidOne) && !db.HaveCoins(GetRandHash()));
+    BOOST_CHECK(db.Upgrade());
+
+    CCoinsViewCache cache(&db);
+    CTxInUndo undo;
+    BOOST_CHECK(cache.ModifyCoins(txidMany)->Spend(COutPoint(txidMany, 1), undo));
+    coinsMany.vout[1].SetNull();
+    // The undo data of every output carries the metadata of its transaction
+    BOOST_CHECK(undo.nHeight == 100 && undo.fCoinStake && !undo.fCoinBase && undo.nVersion == 1);
+    cache.ModifyCoins(txidOne)->Spend(0);
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(db.GetCoins(txidMany, coins) && coins == coinsMany);
+    BOOST_CHECK(!db.HaveCoins(txidOne));
+
+    // Spending the last outputs leaves the others in place
+    for (int i = 200; i < 300; i++) {
+        cache.ModifyCoins(txidMany)->Spend(i);
+        coinsMany.vout[i].SetNull();
+    }
+    coinsMany.Cleanup();
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txidMany, coins) && coins == coinsMany);
+    BOOST_CHECK_EQUAL(coins.vout.size(), 200U);
+
+    // The running statistics follow the writes
+    CCoinsStats stats, statsScanned;
+    BOOST_CHECK(db.GetStats(stats, false));
+    BOOST_CHECK(db.GetStats(statsScanned, true));
+    BOOST_CHECK_EQUAL(stats.nTransactions, 1U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, 132U);
+    BOOST_CHECK_EQUAL(stats.nTransactions, statsScanned.nTransactions);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, statsScanned.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(stats.nSerializedSize, statsScanned.nSerializedSize);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, statsScanned.nTotalAmount);
+    BOOST_CHECK(stats.hashMuHash == statsScanned.hashMuHash);
+
+    // A duplicate txid at another height replaces all records of the transaction
+    CCoins coinsDup;
+    coinsDup.nVersion = 1;
+    coinsDup.nHeight = 150;
+    coinsDup.vout.resize(3);
+    coinsDup.vout[2].nValue = 7;
+    coinsDup.vout[2].scriptPubKey = CScript() << OP_TRUE;
+    *cache.ModifyCoins(txidMany) = coinsDup;
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txidMany, coins) && coins == coinsDup);
+    CCoinsStats statsDup, statsDupScanned;
+    BOOST_CHECK(db.GetStats(statsDup, false));
+    BOOST_CHECK(db.GetStats(statsDupScanned, true));
+    BOOST_CHECK_EQUAL(statsDup.nTransactionOutputs, 1U);
+    BOOST_CHECK_EQUAL(statsDup.nTransactionOutputs, statsDupScanned.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsDup.nTotalAmount, statsDupScanned.nTotalAmount);
+    BOOST_CHECK(statsDup.hashMuHash == statsDupScanned.hashMuHash);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
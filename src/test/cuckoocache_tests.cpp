@@ -0,0 +1,95 @@
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "random.h"
+#include "uint256.h"
+#include "test/test_nbx.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+class CacheHasher
+{
+public:
+    uint32_t operator()(const uint256& key, uint8_t n) const
+    {
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * n, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, CacheHasher> TestCache;
+
+static std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> v;
+    for (size_t i = 0; i < n; i++)
+        v.push_back(GetRandHash());
+    return v;
+}
+
+static double HitRate(const TestCache& cache, const std::vector<uint256>& v, size_t nBegin, size_t nEnd)
+{
+    size_t nHits = 0;
+    for (size_t i = nBegin; i < nEnd; i++)
+        nHits += cache.contains(v[i], false);
+    return (double)nHits / (nEnd - nBegin);
+}
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_empty)
+{
+    TestCache cache;
+    uint256 hash = GetRandHash();
+    BOOST_CHECK(!cache.contains(hash, false));
+    cache.insert(hash);
+    BOOST_CHECK(!cache.contains(hash, false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    TestCache cache;
+    uint32_t nSize = cache.setup_bytes(1 << 20);
+    BOOST_CHECK_EQUAL(nSize, (1 << 20) / sizeof(uint256));
+
+    // Half full, everything fits
+    std::vector<uint256> v = RandomHashes(nSize * 2);
+    for (size_t i = 0; i < nSize / 2; i++)
+        cache.insert(v[i]);
+    BOOST_CHECK(HitRate(cache, v, 0, nSize / 2) > 0.99);
+    BOOST_CHECK_EQUAL(HitRate(cache, v, nSize, nSize * 2), 0.0);
+
+    // Over-filled, the newest elements are kept
+    for (size_t i = nSize / 2; i < nSize * 2; i++)
+        cache.insert(v[i]);
+    BOOST_CHECK(HitRate(cache, v, nSize * 2 - nSize / 4, nSize * 2) > 0.95);
+    BOOST_CHECK(HitRate(cache, v, 0, nSize / 2) < 0.5);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    TestCache cache;
+    uint32_t nSize = cache.setup(1 << 14);
+    std::vector<uint256> v = RandomHashes(nSize * 2);
+    for (size_t i = 0; i < nSize; i++)
+        cache.insert(v[i]);
+
+    // Erased elements are still found until their slot is reused
+    for (size_t i = 0; i < nSize; i++)
+        cache.contains(v[i], true);
+    BOOST_CHECK(HitRate(cache, v, 0, nSize / 4) > 0.5);
+
+    // A full table of erased elements makes room for as many new ones
+    for (size_t i = nSize; i < nSize * 2; i++)
+        cache.insert(v[i]);
+    BOOST_CHECK(HitRate(cache, v, nSize, nSize * 2) > 0.85);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "muhash.h"
+#include "streams.h"
 #include "utilstrencodings.h"
 #include "test/test_nbx.h"
 
@@ -45,4 +47,74 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vectors from the SipHash paper, key 000102..0f and message 00, 01, ...
+    static const uint64_t vectors[] = {
+        0x726fdb47dd0e0e31ULL, 0x74f839c593dc67fdULL, 0x0d6c8009d9a94f5aULL, 0x85676696d7fb7e2dULL,
+        0xcf2794e0277187b7ULL, 0x18765564cd99a68dULL, 0xcbc9466e58fee3ceULL, 0xab0200f58b01d137ULL,
+        0x93f5f5799a932462ULL, 0x9e0082df0ba9e4b0ULL, 0x7a5dbbc594ddb9f3ULL, 0xf4b32f46226bada7ULL,
+        0x751e8fbc860ee5fbULL, 0x14ea5627c0843d90ULL, 0xf723ca908e7af2eeULL, 0xa129ca6149be45e5ULL};
+    const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0F0E0D0C0B0A0908ULL;
+
+    unsigned char data[16];
+    for (int i = 0; i < 16; i++) {
+        BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(data, i).Finalize(), vectors[i]);
+        data[i] = i;
+    }
+
+    // Byte-wise, word-wise and uint256 hashing of the same 32 bytes agree
+    CSipHasher hasher(k0, k1);
+    hasher.Write(0x0706050403020100ULL).Write(0x0F0E0D0C0B0A0908ULL);
+    hasher.Write(0x1716151413121110ULL).Write(0x1F1E1D1C1B1A1918ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x7127512f72f27cceULL);
+    std::vector<unsigned char> vch = ParseHex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f");
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(vch.data(), vch.size()).Finalize(), 0x7127512f72f27cceULL);
+    BOOST_CHECK_EQUAL(SipHashUint256(k0, k1, uint256("0x1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceULL);
+
+    // Four more bytes 20..23, the tail of a 36 byte message
+    const unsigned char extra[4] = {0x20, 0x21, 0x22, 0x23};
+    hasher.Write(extra, 4);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x314dffbe0815a3b4ULL);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(k0, k1, uint256("0x1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100"), 0x23222120), 0x314dffbe0815a3b4ULL);
+}
+
+BOOST_AUTO_TEST_CASE(muhash)
+{
+    const unsigned char a[3] = {1, 2, 3};
+    const unsigned char b[2] = {4, 5};
+
+    // The empty set hashes the number 1
+    CMuHash3072 empty;
+    BOOST_CHECK_EQUAL(empty.Finalize().GetHex(), "a5565d0f791a956bce308affcc938701a132cbff1a5266d12e14ecfba54216ab");
+
+    // The order of the updates does not matter, and a removal cancels an insertion
+    CMuHash3072 h1, h2, h3;
+    h1.Insert(a, sizeof(a));
+    h1.Insert(b, sizeof(b));
+    h2.Remove(a, sizeof(a));
+    h2.Insert(b, sizeof(b));
+    h2.Insert(a, sizeof(a));
+    h2.Insert(a, sizeof(a));
+    h3.Insert(b, sizeof(b));
+    BOOST_CHECK(h1.Finalize() == h2.Finalize());
+    BOOST_CHECK(h1.Finalize() != h3.Finalize());
+    h1.Remove(a, sizeof(a));
+    BOOST_CHECK(h1.Finalize() == h3.Finalize());
+    BOOST_CHECK(h1.Finalize() != empty.Finalize());
+
+    // Combining two sets is the same as inserting into one
+    CMuHash3072 h4;
+    h4.Insert(a, sizeof(a));
+    h4 *= h3;
+    BOOST_CHECK(h4.Finalize() == h2.Finalize());
+
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << h2;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * CMuHash3072::BYTE_SIZE);
+    CMuHash3072 h5;
+    ss >> h5;
+    BOOST_CHECK(h5.Finalize() == h2.Finalize());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
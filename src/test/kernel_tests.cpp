@@ -0,0 +1,178 @@
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+#include "random.h"
+#include "test/test_nbx.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#define KERNEL_SEARCH_INPUTS 20000
+#define KERNEL_SEARCH_DRIFT 60
+
+static CStakeKernel MakeKernel(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const uint256& txid, unsigned int n, const uint256& bnTarget)
+{
+    CDataStream ssModifier(SER_GETHASH, 0);
+    ssModifier << nStakeModifier;
+    CDataStream ssUniqueID(SER_NETWORK, 0);
+    ssUniqueID << n << txid;
+
+    CStakeKernel kernel;
+    kernel.SetPrefix(ssModifier, nTimeBlockFrom, ssUniqueID, bnTarget);
+    return kernel;
+}
+
+// Forward walk GetKernelStakeModifier did before the index (2087s is the v1 selection interval)
+static const CBlockIndex* WalkModifierBlock(const std::vector<CBlockIndex*>& vChain, int nHeightFrom)
+{
+    int64_t nModifierTime = vChain[nHeightFrom]->GetBlockTime();
+    for (size_t i = nHeightFrom + 1; i < vChain.size(); i++) {
+        if (vChain[i]->GeneratedStakeModifier())
+            nModifierTime = vChain[i]->GetBlockTime();
+        if (nModifierTime >= vChain[nHeightFrom]->GetBlockTime() + 2087)
+            return vChain[i];
+    }
+    return NULL;
+}
+
+static void ExtendChain(std::vector<CBlockIndex*>& vChain, std::vector<CBlockIndex*>& vStorage, int nForkHeight, int nLength)
+{
+    vChain.resize(nForkHeight + 1);
+    for (int i = 0; i < nLength; i++) {
+        CBlockIndex* pindex = new CBlockIndex();
+        CBlockIndex* pprev = vChain.empty() ? NULL : vChain.back();
+        pindex->pprev = pprev;
+        pindex->nHeight = pprev ? pprev->nHeight + 1 : 0;
+        // Mostly increasing, sometimes out of order, timestamps
+        pindex->nTime = (pprev ? pprev->nTime : 1500000000) + 60 - 90 + GetRand(180);
+        pindex->SetStakeModifier(GetRand(std::numeric_limits<uint64_t>::max()), GetRand(3) == 0);
+        pindex->BuildSkip();
+        vStorage.push_back(pindex);
+        vChain.push_back(pindex);
+    }
+}
+
+static void CheckModifierIndex(const CStakeModifierIndex& index, const std::vector<CBlockIndex*>& vChain)
+{
+    for (size_t i = 0; i < vChain.size(); i++) {
+        const CBlockIndex* pindexExpected = WalkModifierBlock(vChain, i);
+        const CBlockIndex* pindexModifier = NULL;
+        bool fFound = index.GetModifierBlock(vChain[i], pindexModifier);
+        BOOST_CHECK_EQUAL(fFound, pindexExpected != NULL);
+        if (fFound)
+            BOOST_CHECK(pindexModifier == pindexExpected);
+    }
+}
+
+BOOST_FIXTURE_TEST_SUITE(kernel_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index)
+{
+    std::vector<CBlockIndex*> vStorage;
+    std::vector<CBlockIndex*> vChain;
+    ExtendChain(vChain, vStorage, -1, 3000);
+    std::vector<CBlockIndex*> vMain = vChain;
+
+    CStakeModifierIndex index;
+    const CBlockIndex* pindexModifier = NULL;
+    index.SetTip(vChain.back());
+    CheckModifierIndex(index, vChain);
+
+    // Short reorg, undone from the undo data
+    ExtendChain(vChain, vStorage, 2950, 100);
+    index.SetTip(vChain.back());
+    CheckModifierIndex(index, vChain);
+    BOOST_CHECK(!index.GetModifierBlock(vMain[2990], pindexModifier));
+
+    // Deeper than the undo data, rebuilt
+    ExtendChain(vChain, vStorage, 3050 - STAKE_MODIFIER_INDEX_UNDO_DEPTH - 100, 200);
+    index.SetTip(vChain.back());
+    CheckModifierIndex(index, vChain);
+
+    // Back to the original chain, then block by block
+    for (size_t i = 2500; i < vMain.size(); i++)
+        index.SetTip(vMain[i]);
+    CheckModifierIndex(index, vMain);
+
+    index.SetTip(NULL);
+    BOOST_CHECK(!index.GetModifierBlock(vMain[10], pindexModifier));
+
+    for (CBlockIndex* pindex : vStorage)
+        delete pindex;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_prefix_hash)
+{
+    // The prefix hash must match the stream GetHashProofOfStake builds
+    for (int i = 0; i < 100; i++) {
+        uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        unsigned int nTimeBlockFrom = 1500000000 + i;
+        unsigned int nTimeTx = nTimeBlockFrom + 3600 + GetRand(1000);
+        uint256 txid = GetRandHash();
+
+        CStakeKernel kernel = MakeKernel(nStakeModifier, nTimeBlockFrom, txid, i, 0);
+
+        CDataStream ssUniqueID(SER_NETWORK, 0);
+        ssUniqueID << (unsigned int)i << txid;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << nStakeModifier << nTimeBlockFrom << ssUniqueID << nTimeTx;
+        BOOST_CHECK(kernel.GetHash(nTimeTx) == Hash(ss.begin(), ss.end()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search)
+{
+    // Roughly one hit per few hundred inputs
+    uint256 bnTarget = ~uint256(0) / (KERNEL_SEARCH_DRIFT * 300);
+    std::vector<CStakeKernel> vKernels;
+    for (int i = 0; i < KERNEL_SEARCH_INPUTS; i++)
+        vKernels.push_back(MakeKernel(GetRand(std::numeric_limits<uint64_t>::max()), 1500000000, GetRandHash(), i, bnTarget));
+
+    const unsigned int nTimeFrom = 1600000000;
+    const unsigned int nTimeTo = nTimeFrom + KERNEL_SEARCH_DRIFT;
+
+    // Serial reference
+    int nExpected = -1;
+    unsigned int nExpectedTime = 0;
+    for (int i = 0; i < KERNEL_SEARCH_INPUTS && nExpected < 0; i++) {
+        uint256 hash;
+        for (unsigned int t = nTimeFrom; t <= nTimeTo; t++) {
+            if (vKernels[i].CheckHash(t, hash)) {
+                nExpected = i;
+                nExpectedTime = t;
+                break;
+            }
+        }
+    }
+
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        int nKernel = SearchStakeKernels(vKernels, 0, nTimeFrom, nTimeTo, nThreads, nullptr);
+        BOOST_CHECK_EQUAL(nKernel, nExpected);
+        if (nKernel >= 0) {
+            BOOST_CHECK_EQUAL(vKernels[nKernel].nTimeTx, nExpectedTime);
+            BOOST_CHECK(vKernels[nKernel].hashProofOfStake == vKernels[nKernel].GetHash(nExpectedTime));
+
+            // Resuming after a rejected kernel only finds later ones
+            int nNext = SearchStakeKernels(vKernels, nKernel + 1, nTimeFrom, nTimeTo, nThreads, nullptr);
+            BOOST_CHECK(nNext < 0 || nNext > nKernel);
+        }
+    }
+
+    // With an unreachable target every input is swept over the full drift
+    std::vector<CStakeKernel> vMisses;
+    for (int i = 0; i < 1000; i++)
+        vMisses.push_back(MakeKernel(GetRand(std::numeric_limits<uint64_t>::max()), 1500000000, GetRandHash(), i, 0));
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        uint64_t nHashes = 0;
+        BOOST_CHECK_EQUAL(SearchStakeKernels(vMisses, 0, nTimeFrom, nTimeTo, nThreads, nullptr, &nHashes), -1);
+        BOOST_CHECK_EQUAL(nHashes, (uint64_t)vMisses.size() * (KERNEL_SEARCH_DRIFT + 1));
+    }
+
+    // An interrupted search finds nothing
+    BOOST_CHECK_EQUAL(SearchStakeKernels(vKernels, 0, nTimeFrom, nTimeTo, 4, []() { return true; }), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
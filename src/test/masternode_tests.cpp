@@ -0,0 +1,160 @@
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "random.h"
+#include "utiltime.h"
+#include "test/test_nbx.h"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#define MN_TEST_COUNT 3000
+#define MN_TEST_PROTOCOL 70000
+
+struct CompareScoreRef {
+    bool operator()(const std::pair<int64_t, CTxIn>& t1,
+        const std::pair<int64_t, CTxIn>& t2) const
+    {
+        return t1.first < t2.first;
+    }
+};
+
+// The rankings as CMasternodeMan computed them before the score tables
+static CTxIn RefCurrentMasterNode(std::vector<CMasternode>& vMasternodes, int64_t nBlockHeight, int minProtocol)
+{
+    int64_t score = 0;
+    CTxIn winner;
+    for (CMasternode& mn : vMasternodes) {
+        if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+        int64_t n2 = mn.CalculateScore(1, nBlockHeight).GetCompact(false);
+        if (n2 > score) {
+            score = n2;
+            winner = mn.vin;
+        }
+    }
+    return winner;
+}
+
+static std::vector<std::pair<int64_t, CTxIn> > RefSortedScores(std::vector<CMasternode>& vMasternodes, int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fMinAge, bool fDisabledLast)
+{
+    std::vector<std::pair<int64_t, CTxIn> > vecMasternodeScores;
+    for (CMasternode& mn : vMasternodes) {
+        if (mn.protocolVersion < minProtocol) continue;
+        if (fMinAge && GetAdjustedTime() - mn.sigTime < 8000) continue;
+        if (fOnlyActive && !mn.IsEnabled()) continue;
+        if (fDisabledLast && !mn.IsEnabled()) {
+            vecMasternodeScores.push_back(std::make_pair(9999, mn.vin));
+            continue;
+        }
+        vecMasternodeScores.push_back(std::make_pair(mn.CalculateScore(1, nBlockHeight).GetCompact(false), mn.vin));
+    }
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreRef());
+    return vecMasternodeScores;
+}
+
+BOOST_FIXTURE_TEST_SUITE(masternode_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(masternode_score_ranks)
+{
+    std::vector<uint256> vHashes(200);
+    std::vector<CBlockIndex> vBlocks(vHashes.size());
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vHashes[i] = GetRandHash();
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nHeight = i;
+    }
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(&vBlocks.back());
+        chainActiveHashes.SetTip();
+    }
+
+    // enabled, too young for GetMasternodeRank, expired and on an older protocol
+    CMasternodeMan mnman;
+    int64_t nNow = GetAdjustedTime();
+    for (int i = 0; i < MN_TEST_COUNT; i++) {
+        CMasternode mn;
+        mn.unitTest = true;
+        mn.vin = CTxIn(COutPoint(GetRandHash(), i % 4));
+        mn.protocolVersion = i % 7 == 0 ? MN_TEST_PROTOCOL - 1 : MN_TEST_PROTOCOL;
+        mn.sigTime = nNow - (i % 5 == 0 ? 60 * 60 : 3 * 60 * 60);
+        mn.lastPing = CMasternodePing(mn.vin);
+        mn.lastPing.sigTime = i % 11 == 0 ? nNow - 125 * 60 : nNow;
+        BOOST_CHECK(mnman.Add(mn));
+    }
+
+    std::vector<CMasternode> vMasternodes = mnman.GetFullMasternodeVector();
+    BOOST_CHECK_EQUAL(vMasternodes.size(), (size_t)MN_TEST_COUNT);
+
+    int nCollisions = 0;
+    for (int64_t nHeight = 100; nHeight < 104; nHeight++) {
+        std::vector<std::pair<int64_t, CTxIn> > vAll = RefSortedScores(vMasternodes, nHeight, 0, false, false, false);
+        for (size_t i = 1; i < vAll.size(); i++)
+            if (vAll[i].first == vAll[i - 1].first) nCollisions++;
+
+        for (int minProtocol = 0; minProtocol <= MN_TEST_PROTOCOL; minProtocol += MN_TEST_PROTOCOL) {
+            CMasternode* pmn = mnman.GetCurrentMasterNode(1, nHeight, minProtocol);
+            CTxIn vinRef = RefCurrentMasterNode(vMasternodes, nHeight, minProtocol);
+            BOOST_CHECK(pmn != NULL);
+            if (pmn) BOOST_CHECK(pmn->vin == vinRef);
+
+            std::vector<std::pair<int64_t, CTxIn> > vRanks = RefSortedScores(vMasternodes, nHeight, minProtocol, false, false, true);
+            std::vector<std::pair<int, CMasternode> > vecRanks = mnman.GetMasternodeRanks(nHeight, minProtocol);
+            BOOST_CHECK_EQUAL(vecRanks.size(), vRanks.size());
+            for (size_t i = 0; i < std::min(vecRanks.size(), vRanks.size()); i++) {
+                BOOST_CHECK_EQUAL(vecRanks[i].first, (int)i + 1);
+                BOOST_CHECK(vecRanks[i].second.vin == vRanks[i].second);
+            }
+
+            for (int fOnlyActive = 0; fOnlyActive < 2; fOnlyActive++) {
+                std::vector<std::pair<int64_t, CTxIn> > vByRank = RefSortedScores(vMasternodes, nHeight, minProtocol, fOnlyActive, false, false);
+                for (size_t i = 0; i < vByRank.size(); i += 97) {
+                    CMasternode* pmnRank = mnman.GetMasternodeByRank(i + 1, nHeight, minProtocol, fOnlyActive);
+                    BOOST_CHECK(pmnRank != NULL);
+                    if (pmnRank) BOOST_CHECK(pmnRank->vin == vByRank[i].second);
+                }
+                BOOST_CHECK(mnman.GetMasternodeByRank(vByRank.size() + 1, nHeight, minProtocol, fOnlyActive) == NULL);
+
+                std::vector<std::pair<int64_t, CTxIn> > vRank = RefSortedScores(vMasternodes, nHeight, minProtocol, fOnlyActive, true, false);
+                std::set<COutPoint> setRanked;
+                for (size_t i = 0; i < vRank.size(); i++) {
+                    setRanked.insert(vRank[i].second.prevout);
+                    if (i % 97 == 0)
+                        BOOST_CHECK_EQUAL(mnman.GetMasternodeRank(vRank[i].second, nHeight, minProtocol, fOnlyActive), (int)i + 1);
+                }
+                for (size_t i = 0; i < vMasternodes.size(); i += 97) {
+                    if (!setRanked.count(vMasternodes[i].vin.prevout))
+                        BOOST_CHECK_EQUAL(mnman.GetMasternodeRank(vMasternodes[i].vin, nHeight, minProtocol, fOnlyActive), -1);
+                }
+            }
+        }
+    }
+    // the compact scores must tie for the list order to matter
+    BOOST_CHECK(nCollisions > 0);
+
+    // unknown blocks: no winner and no ranks, the ranking by rank scores everybody 0
+    int64_t nUnknown = chainActive.Height() + 5;
+    BOOST_CHECK(mnman.GetCurrentMasterNode(1, nUnknown, 0) == NULL);
+    BOOST_CHECK(mnman.GetMasternodeRanks(nUnknown, 0).empty());
+    BOOST_CHECK_EQUAL(mnman.GetMasternodeRank(vMasternodes[0].vin, nUnknown, 0, false), -1);
+    std::vector<std::pair<int64_t, CTxIn> > vZero = RefSortedScores(vMasternodes, nUnknown, 0, false, false, false);
+    CMasternode* pmnZero = mnman.GetMasternodeByRank(1, nUnknown, 0, false);
+    BOOST_CHECK(pmnZero != NULL);
+    if (pmnZero) BOOST_CHECK(pmnZero->vin == vZero[0].second);
+
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(NULL);
+        chainActiveHashes.SetTip();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -99,4 +99,271 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+template <typename name>
+void CheckSort(CTxMemPool& pool, std::vector<std::string>& sortedOrder)
+{
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    typename CTxMemPool::indexed_transaction_set::index<name>::type::iterator it = pool.mapTx.get<name>().begin();
+    int count = 0;
+    for (; it != pool.mapTx.get<name>().end(); ++it, ++count) {
+        BOOST_CHECK_EQUAL(it->GetTx().GetHash().ToString(), sortedOrder[count]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Three unrelated transactions of equal size
+    CMutableTransaction tx1, tx2, tx3;
+    CMutableTransaction* vtx[3] = {&tx1, &tx2, &tx3};
+    for (int i = 0; i < 3; i++) {
+        vtx[i]->vin.resize(1);
+        vtx[i]->vin[0].scriptSig = CScript() << OP_11;
+        vtx[i]->vin[0].prevout.hash = uint256(i + 1);
+        vtx[i]->vout.resize(1);
+        vtx[i]->vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vtx[i]->vout[0].nValue = 10 * COIN;
+    }
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 20000LL, 0, 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0LL, 0, 0.0, 1));
+
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    CheckSort<fee_rate>(pool, sortedOrder);
+    CheckSort<ancestor_score>(pool, sortedOrder);
+
+    // A child paying well for the free tx3 ranks by fee rate alone, but
+    // stays below tx1 by ancestor score since its package pays less per byte
+    CMutableTransaction tx4;
+    tx4.vin.resize(1);
+    tx4.vin[0].scriptSig = CScript() << OP_11;
+    tx4.vin[0].prevout.hash = tx3.GetHash();
+    tx4.vin[0].prevout.n = 0;
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 15000LL, 0, 0.0, 1));
+
+    sortedOrder.clear();
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    CheckSort<fee_rate>(pool, sortedOrder);
+
+    sortedOrder.clear();
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    CheckSort<ancestor_score>(pool, sortedOrder);
+
+    // Prioritising the parent moves it first, and its child ahead of tx1
+    pool.PrioritiseTransaction(tx3.GetHash(), tx3.GetHash().ToString(), 0.0, 30000LL);
+    sortedOrder.clear();
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    CheckSort<ancestor_score>(pool, sortedOrder);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of three transactions
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = i ? tx[i - 1].GetHash() : uint256(1);
+        tx[i].vin[0].prevout.n = 0;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    CTxMemPoolEntry entry(tx[0], 1000LL, 0, 0.0, 1);
+    uint64_t nTxSize = entry.GetTxSize();
+    for (int i = 0; i < 3; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000LL * (i + 1), 0, 0.0, 1));
+
+    CTxMemPool::txiter it = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 6000LL);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(it).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it).size(), 0);
+    it = pool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 6000LL);
+    it = pool.mapTx.find(tx[2].GetHash());
+
+    CTxMemPool::setEntries setAncestors;
+    pool.CalculateMemPoolAncestors(*it, setAncestors, false);
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+
+    // Fee deltas reach the descendants
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 500LL);
+    it = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 6500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetModifiedFee(), 1500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetModFeesWithDescendants(), 6500LL);
+
+    // The first transaction is mined: the others lose it from their packages
+    std::list<CTransaction> removed;
+    pool.remove(tx[0], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    it = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), 2 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 5000LL);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(pool.mapTx.find(tx[1].GetHash())).size(), 0);
+
+    // ... and is disconnected again, it returns below its children
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000LL, 0, 0.0, 1));
+    it = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 6500LL);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(pool.mapTx.find(tx[0].GetHash())).size(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[1].GetHash())->GetCountWithDescendants(), 2);
+
+    // Removing the middle one takes its child along
+    pool.remove(tx[1], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(pool.mapTx.find(tx[0].GetHash())).size(), 0);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetModFeesWithDescendants(), 1500LL);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of four transactions, the last one not in the pool
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = i ? tx[i - 1].GetHash() : uint256(1);
+        tx[i].vin[0].prevout.n = 0;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    for (int i = 0; i < 3; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000LL, 0, 0.0, 1));
+    CTxMemPoolEntry entry(tx[3], 1000LL, 0, 0.0, 1);
+    uint64_t nTxSize = entry.GetTxSize();
+
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry, setAncestors, 4, 4 * nTxSize, 4, 4 * nTxSize, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+
+    // Too many ancestors, too large a package
+    CTxMemPool::setEntries setAncestorsCount, setAncestorsSize;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestorsCount, 3, 4 * nTxSize, 4, 4 * nTxSize, errString));
+    BOOST_CHECK(!errString.empty());
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestorsSize, 4, 4 * nTxSize - 1, 4, 4 * nTxSize, errString));
+
+    // The first transaction would get a fourth descendant
+    CTxMemPool::setEntries setDescendantsCount, setDescendantsSize;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setDescendantsCount, 4, 4 * nTxSize, 3, 4 * nTxSize, errString));
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setDescendantsSize, 4, 4 * nTxSize, 4, 4 * nTxSize - 1, errString));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = uint256(i + 1);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    // tx[2] spends tx[1], and pays enough to keep it above tx[0]
+    tx[2].vin[0].prevout.hash = tx[1].GetHash();
+    int64_t nTime = GetTime();
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 10000LL, nTime, 0.0, 1));
+    pool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 5000LL, nTime, 0.0, 1));
+    pool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 20000LL, nTime, 0.0, 1));
+    pool.addUnchecked(tx[3].GetHash(), CTxMemPoolEntry(tx[3], 0LL, nTime, 0.0, 1));
+    size_t nTxSize = pool.mapTx.find(tx[0].GetHash())->GetTxSize();
+    BOOST_CHECK(pool.DynamicMemoryUsage() > 4 * nTxSize);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    // The free transaction goes first, and the minimum fee becomes the relay fee
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx[3].GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(1000));
+
+    // Then tx[0], whose fee rate plus the relay fee is the new minimum
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+    CAmount nMinFeeRate = CFeeRate(10000LL, nTxSize).GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFeeRate);
+
+    // Then tx[1] together with its child, at their package fee rate
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    nMinFeeRate = CFeeRate(25000LL, 2 * nTxSize).GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFeeRate);
+    BOOST_CHECK_EQUAL(pool.GetEvictedCount(), 4);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+
+    // The minimum fee only decays once a block has come in
+    SetMockTime(nTime + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFeeRate);
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(nTime + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), (CAmount)(nMinFeeRate / 2.0));
+
+    // ... down to zero once it falls below half the relay fee
+    SetMockTime(nTime + 20 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpiryTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // An old transaction with a recent child, and a recent one
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = uint256(i + 1);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    tx[1].vin[0].prevout.hash = tx[0].GetHash();
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000LL, 100, 0.0, 1));
+    pool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 1000LL, 300, 0.0, 1));
+    pool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 1000LL, 200, 0.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(tx[2].GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetExpiredCount(), 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -101,4 +101,63 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockhashindex_test)
+{
+    // Main chain of 1000 blocks and a branch that splits off at block 899.
+    std::vector<uint256> vHashMain(1000);
+    std::vector<CBlockIndex> vBlocksMain(1000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vHashMain[i] = i;
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].phashBlock = &vHashMain[i];
+    }
+    std::vector<uint256> vHashSide(50);
+    std::vector<CBlockIndex> vBlocksSide(50);
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vHashSide[i] = i + 900 + (uint256(1) << 128);
+        vBlocksSide[i].nHeight = i + 900;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[899];
+        vBlocksSide[i].phashBlock = &vHashSide[i];
+    }
+
+    CChain chain;
+    CBlockHashIndex index(chain, 128);
+    uint256 hash;
+    BOOST_CHECK(!index.GetBlockHash(0, hash));
+
+    // Connect the main chain one block at a time.
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        chain.SetTip(&vBlocksMain[i]);
+        index.SetTip();
+    }
+    BOOST_CHECK_EQUAL(index.Height(), 999);
+    for (int i=1000-128; i<1000; i++) {
+        BOOST_CHECK(index.GetBlockHash(i, hash));
+        BOOST_CHECK(hash == vHashMain[i]);
+    }
+    BOOST_CHECK(!index.GetBlockHash(1000, hash));
+    // Older than the window
+    BOOST_CHECK(!index.GetBlockHash(1000-129, hash));
+    BOOST_CHECK(!index.GetBlockHash(0, hash));
+
+    // Reorganize to the side branch, which is shorter.
+    chain.SetTip(&vBlocksMain[899]);
+    index.SetTip();
+    chain.SetTip(&vBlocksSide.back());
+    index.SetTip();
+    BOOST_CHECK_EQUAL(index.Height(), 949);
+    for (int i=950-128; i<950; i++) {
+        BOOST_CHECK(index.GetBlockHash(i, hash));
+        BOOST_CHECK(hash == (i < 900 ? vHashMain[i] : vHashSide[i - 900]));
+    }
+    BOOST_CHECK(!index.GetBlockHash(950, hash));
+    BOOST_CHECK(!index.GetBlockHash(950-129, hash));
+
+    chain.SetTip(NULL);
+    index.SetTip();
+    BOOST_CHECK_EQUAL(index.Height(), -1);
+    BOOST_CHECK(!index.GetBlockHash(0, hash));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -35,6 +35,8 @@ BasicTestingSetup::BasicTestingSetup()
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
+        InitSignatureCache();
+        InitScriptExecutionCache();
 }
 BasicTestingSetup::~BasicTestingSetup()
 {
@@ -0,0 +1,82 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Copyright (c) 2018-2021 Netbox.Global
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "test/test_nbx.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txvalidationcache_tests, TestingSetup)
+
+static void SetSpentScript(CCoinsViewCache& view, const uint256& txid, const CScript& scriptPubKey)
+{
+    view.ModifyCoins(txid)->vout[0].scriptPubKey = scriptPubKey;
+}
+
+// The script execution cache is keyed by txid and flags. A hit returns before the scripts
+// run, which shows here as a transaction passing although the output it spends was
+// replaced by one that fails.
+BOOST_AUTO_TEST_CASE(script_execution_cache)
+{
+    LOCK(cs_main);
+
+    // CheckInputs takes the spend height from the block index entry of the best block
+    uint256 hashBest = GetRandHash();
+    CBlockIndex index;
+    index.nHeight = 1000;
+    mapBlockIndex[hashBest] = &index;
+
+    CCoinsView viewDummy;
+    CCoinsViewCache view(&viewDummy);
+    view.SetBestBlock(hashBest);
+
+    uint256 txidPrev = GetRandHash();
+    {
+        CCoinsModifier coins = view.ModifyCoins(txidPrev);
+        coins->nVersion = 1;
+        coins->nHeight = 900;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 10 * COIN;
+    }
+    SetSpentScript(view, txidPrev, CScript() << OP_TRUE);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(txidPrev, 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 9 * COIN;
+    mtx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CTransaction tx(mtx);
+
+    CValidationState state;
+    const unsigned int flagsStandard = STANDARD_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+
+    // An entry recorded under other flags misses, and without cacheFullScriptStore nothing is recorded
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flagsStandard, true, true));
+    BOOST_CHECK(CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, true, false));
+    SetSpentScript(view, txidPrev, CScript() << OP_FALSE);
+    BOOST_CHECK(!CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, false, false));
+
+    // A just-check lookup keeps the entry, a block connect consumes it
+    SetSpentScript(view, txidPrev, CScript() << OP_TRUE);
+    BOOST_CHECK(CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, true, true));
+    SetSpentScript(view, txidPrev, CScript() << OP_FALSE);
+    BOOST_CHECK(CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, true, true));
+    BOOST_CHECK(CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, false, false));
+    BOOST_CHECK(!CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, false, false));
+
+    // Without script checks nothing is looked up or recorded
+    SetSpentScript(view, txidPrev, CScript() << OP_TRUE);
+    BOOST_CHECK(CheckInputs(tx, state, view, false, BLOCK_SCRIPT_VERIFY_FLAGS, true, true));
+    SetSpentScript(view, txidPrev, CScript() << OP_FALSE);
+    BOOST_CHECK(!CheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, false, false));
+
+    mapBlockIndex.erase(hashBest);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
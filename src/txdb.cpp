@@ -7,6 +7,8 @@
 
 #include "txdb.h"
 
+#include "guiinterface.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
 #include "uint256.h"
@@ -15,12 +17,140 @@
 
 #include <boost/thread.hpp>
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(std::make_pair('c', hash));
+//! Key of the 'C' record of an unspent output, with its index as a VARINT
+class CCoinKey
+{
+public:
+    uint256 txid;
+    unsigned int n;
+
+    CCoinKey(const uint256& txidIn, unsigned int nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Value of the 'T' record of a transaction with unspent outputs: the outputs that have a 'C'
+ * record. Lookups read it first, so misses stop at the bloom filter and writes need not scan
+ * the records of the transaction.
+ */
+class CCoinsMarker
+{
+public:
+    int nHeight;
+    std::vector<unsigned char> vAvail;
+
+    CCoinsMarker() : nHeight(0) {}
+
+    explicit CCoinsMarker(const CCoins& coins) : nHeight(coins.nHeight)
+    {
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull()) {
+                vAvail.resize(i / 8 + 1, 0);
+                vAvail[i / 8] |= 1 << (i % 8);
+            }
+        }
+    }
+
+    bool IsStored(unsigned int n) const { return n / 8 < vAvail.size() && (vAvail[n / 8] & (1 << (n % 8))); }
+    unsigned int Size() const { return vAvail.size() * 8; }
+    bool IsEmpty() const { return vAvail.empty(); }
+    bool operator==(const CCoinsMarker& other) const { return nHeight == other.nHeight && vAvail == other.vAvail; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(nHeight));
+        READWRITE(vAvail);
+    }
+};
+
+/** Account for the record of output n of txid in the statistics */
+void ApplyCoinRecord(CCoinsDBStats& stats, const uint256& txid, unsigned int n, const Coin& coin, bool fAdd)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'C' << CCoinKey(txid, n);
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << coin;
+    stats.ApplyRecord(&ssKey[0], ssKey.size(), &ssValue[0], ssValue.size(), fAdd);
+}
+
+/**
+ * Write the outputs of coins that markerOld does not list yet, and erase the records of spent outputs.
+ * Records of a transaction at the same height are the same outputs, so only the erased ones are read
+ * back, for the statistics.
+ */
+bool BatchWriteCoins(const CLevelDBWrapper& db, CLevelDBBatch& batch, CCoinsDBStats& stats, const uint256& hash, const CCoins& coins, const CCoinsMarker& markerOld, size_t& nWritten, size_t& nErased)
+{
+    CCoinsMarker markerNew(coins);
+    if (markerNew == markerOld)
+        return true;
+
+    const bool fSameTx = markerOld.nHeight == coins.nHeight;
+    for (unsigned int i = 0; i < markerOld.Size(); i++) {
+        if (!markerOld.IsStored(i) || (fSameTx && coins.IsAvailable(i)))
+            continue;
+        Coin coin;
+        if (!db.Read(std::make_pair('C', CCoinKey(hash, i)), coin))
+            return error("%s : missing record of output %u of %s", __func__, i, hash.ToString());
+        ApplyCoinRecord(stats, hash, i, coin, false);
+        if (!coins.IsAvailable(i)) {
+            batch.Erase(std::make_pair('C', CCoinKey(hash, i)));
+            nErased++;
+        }
+    }
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (coins.IsAvailable(i) && !(fSameTx && markerOld.IsStored(i))) {
+            Coin coin(coins, i);
+            batch.Write(std::make_pair('C', CCoinKey(hash, i)), coin);
+            ApplyCoinRecord(stats, hash, i, coin, true);
+            nWritten++;
+        }
+    }
+
+    if (markerNew.IsEmpty())
+        batch.Erase(std::make_pair('T', hash));
     else
-        batch.Write(std::make_pair('c', hash), coins);
+        batch.Write(std::make_pair('T', hash), markerNew);
+    if (markerOld.IsEmpty() && !markerNew.IsEmpty())
+        stats.nTransactions++;
+    else if (!markerOld.IsEmpty() && markerNew.IsEmpty())
+        stats.nTransactions--;
+    return true;
+}
+}
+
+void CCoinsDBStats::ApplyRecord(const char* pKey, size_t nKeySize, const char* pValue, size_t nValueSize, bool fAdd)
+{
+    Coin coin;
+    CDataStream ssValue(pValue, pValue + nValueSize, SER_DISK, CLIENT_VERSION);
+    ssValue >> coin;
+
+    // The element hashed is the record as stored
+    std::vector<unsigned char> vchRecord(pKey, pKey + nKeySize);
+    vchRecord.insert(vchRecord.end(), pValue, pValue + nValueSize);
+    if (fAdd) {
+        muhash.Insert(&vchRecord[0], vchRecord.size());
+        nTransactionOutputs++;
+        nSerializedSize += vchRecord.size();
+        nTotalAmount += coin.out.nValue;
+    } else {
+        muhash.Remove(&vchRecord[0], vchRecord.size());
+        nTransactionOutputs--;
+        nSerializedSize -= vchRecord.size();
+        nTotalAmount -= coin.out.nValue;
+    }
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
@@ -30,16 +160,31 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDirForDb() + "chainstate", nCacheSize, fMemory, fWipe)
 {
+    // Databases of older versions have none, Upgrade computes them
+    db.Read('S', dbstats);
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(std::make_pair('c', txid), coins);
+    CCoinsMarker marker;
+    if (!db.Read(std::make_pair('T', txid), marker))
+        return false;
+
+    coins.Clear();
+    for (unsigned int i = 0; i < marker.Size(); i++) {
+        if (!marker.IsStored(i))
+            continue;
+        Coin coin;
+        if (!db.Read(std::make_pair('C', CCoinKey(txid, i)), coin))
+            return error("%s : missing record of output %u of %s", __func__, i, txid.ToString());
+        coin.AddTo(coins, i);
+    }
+    return true;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(std::make_pair('c', txid));
+    return db.Exists(std::make_pair('T', txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -50,25 +195,113 @@ uint256 CCoinsViewDB::GetBestBlock() const
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
 {
     CLevelDBBatch batch;
+    CCoinsDBStats statsNew = dbstats;
     size_t count = 0;
     size_t changed = 0;
+    size_t nWritten = 0;
+    size_t nErased = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            // A fresh entry has no records yet, otherwise only the outputs that changed are written
+            CCoinsMarker markerOld;
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH))
+                db.Read(std::make_pair('T', it->first), markerOld);
+            if (!BatchWriteCoins(db, batch, statsNew, it->first, it->second.coins, markerOld, nWritten, nErased))
+                return false;
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else
+            ++it;
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
+    batch.Write('S', statsNew);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database, %u outputs written and %u erased...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)nWritten, (unsigned int)nErased);
+    if (!db.WriteBatch(batch))
+        return false;
+    dbstats = statsNew;
+    return true;
+}
+
+int CCoinsViewDB::GetVersion() const
+{
+    int nVersion = 0;
+    db.Read('V', nVersion);
+    return nVersion;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << 'c';
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    pcursor->Seek(slPrefix);
+    if (pcursor->Valid() && pcursor->key().starts_with(slPrefix)) {
+        LogPrintf("Upgrading the coin database to one record per unspent output...\n");
+        uiInterface.InitMessage(_("Upgrading coin database..."));
+        // Each batch replaces whole transactions, so an interrupted upgrade resumes on the next start
+        CLevelDBBatch batch;
+        size_t nTransactions = 0;
+        size_t nOutputs = 0;
+        for (; pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                uint256 txhash;
+                ssKey >> chType >> txhash;
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                    if (!coins.vout[i].IsNull()) {
+                        batch.Write(std::make_pair('C', CCoinKey(txhash, i)), Coin(coins, i));
+                        nOutputs++;
+                    }
+                }
+                batch.Write(std::make_pair('T', txhash), CCoinsMarker(coins));
+                batch.Erase(std::make_pair('c', txhash));
+            } catch (const std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            if (++nTransactions % 10000 == 0) {
+                if (!db.WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                if (ShutdownRequested()) {
+                    LogPrintf("Coin database upgrade interrupted, it resumes on the next start\n");
+                    return false;
+                }
+            }
+        }
+        HandleError(pcursor->status());
+        if (!db.WriteBatch(batch, true))
+            return false;
+        LogPrintf("Upgraded %u transactions with %u unspent outputs\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    }
+    if (GetVersion() < COINS_DB_VERSION && !db.Write('V', COINS_DB_VERSION, true))
+        return false;
+
+    CCoinsDBStats stored;
+    if (db.Read('S', stored))
+        return true;
+    LogPrintf("Computing the statistics of the coin database...\n");
+    uiInterface.InitMessage(_("Upgrading coin database..."));
+    CCoinsStats stats;
+    if (!ScanStats(stats, dbstats))
+        return false;
+    return db.Write('S', dbstats, true);
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDirForDb() + "blocks" + (char)boost::filesystem::path::preferred_separator + "index", nCacheSize, fMemory, fWipe)
@@ -104,57 +337,98 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+/** Add the unspent outputs of one transaction to the statistics, in the format hashed before the per-output records */
+void static ApplyStats(CCoinsStats& stats, CHashWriter& ss, const uint256& hash, const CCoins& coins)
+{
+    ss << hash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i + 1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
+bool CCoinsViewDB::ScanStats(CCoinsStats& stats, CCoinsDBStats& scanned) const
 {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << 'C';
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    pcursor->Seek(slPrefix);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
+    scanned = CCoinsDBStats();
+    // The records of a transaction are adjacent, gather them before hashing
+    uint256 hashCurrent;
+    CCoins coins;
+    while (pcursor->Valid() && pcursor->key().starts_with(slPrefix)) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            uint256 txhash;
+            unsigned int n = 0;
+            ssKey >> chType >> txhash >> VARINT(n);
+            if (txhash != hashCurrent && !coins.IsPruned()) {
+                ApplyStats(stats, ss, hashCurrent, coins);
+                coins.Clear();
             }
+            hashCurrent = txhash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            coin.AddTo(coins, n);
+            scanned.ApplyRecord(slKey.data(), slKey.size(), slValue.data(), slValue.size(), true);
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+    if (!coins.IsPruned())
+        ApplyStats(stats, ss, hashCurrent, coins);
+    scanned.nTransactions = stats.nTransactions;
+    stats.nSerializedSize = scanned.nSerializedSize;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    stats.hashMuHash = scanned.muhash.Finalize();
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats, bool fFullScan) const
+{
+    if (fFullScan) {
+        CCoinsDBStats scanned;
+        if (!ScanStats(stats, scanned))
+            return false;
+        if (scanned.nTransactions != dbstats.nTransactions || scanned.nTransactionOutputs != dbstats.nTransactionOutputs ||
+            scanned.nSerializedSize != dbstats.nSerializedSize || scanned.nTotalAmount != dbstats.nTotalAmount ||
+            stats.hashMuHash != dbstats.muhash.Finalize())
+            LogPrintf("%s : the running statistics do not match the coin database\n", __func__);
+    } else {
+        stats.hashBlock = GetBestBlock();
+        stats.nTransactions = dbstats.nTransactions;
+        stats.nTransactionOutputs = dbstats.nTransactionOutputs;
+        stats.nSerializedSize = dbstats.nSerializedSize;
+        stats.nTotalAmount = dbstats.nTotalAmount;
+        stats.hashMuHash = dbstats.muhash.Finalize();
+    }
+    BlockMap::const_iterator it = mapBlockIndex.find(stats.hashBlock);
+    stats.nHeight = it != mapBlockIndex.end() ? it->second->nHeight : 0;
     return true;
 }
 
@@ -10,6 +10,7 @@
 
 #include "leveldbwrapper.h"
 #include "main.h"
+#include "muhash.h"
 
 #include <map>
 #include <string>
@@ -25,12 +26,55 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! layout of the chainstate records, stored under 'V' (databases of older versions have none and hold 'c' records)
+static const int COINS_DB_VERSION = 1;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * Running statistics of the records in the coin database. They are updated by
+ * every batch write and stored with the best block, so gettxoutsetinfo does
+ * not need to read the whole database.
+ */
+class CCoinsDBStats
+{
+public:
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    //! MuHash of the key and value of every 'C' record
+    CMuHash3072 muhash;
+
+    CCoinsDBStats() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    //! Account for a record added to (or, with !fAdd, removed from) the database
+    void ApplyRecord(const char* pKey, size_t nKeySize, const char* pValue, size_t nValueSize, bool fAdd);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nSerializedSize));
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    }
+};
+
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/). Each unspent
+ * output is a separate 'C' record keyed by its outpoint; the CCoins of a
+ * transaction are assembled from the records sharing its txid.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    CCoinsDBStats dbstats;
+
+    //! Compute the statistics of the records by reading all of them
+    bool ScanStats(CCoinsStats& stats, CCoinsDBStats& scanned) const;
 
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
@@ -38,8 +82,14 @@ public:
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
-    bool GetStats(CCoinsStats& stats) const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
+    bool GetStats(CCoinsStats& stats, bool fFullScan) const;
+    //! Layout the database was last upgraded to, 0 if it predates per-output records
+    int GetVersion() const;
+
+    //! Convert the per-transaction 'c' records of older versions to per-output
+    //! records, and compute the running statistics if they are missing
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
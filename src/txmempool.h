@@ -15,6 +15,10 @@
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CAutoFile;
 
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
@@ -22,6 +26,11 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Along with the transaction itself, each entry caches the totals of its
+ * in-mempool ancestor and descendant packages (the entry included), so the
+ * pool can be indexed by package fee rate. The totals are kept current by
+ * CTxMemPool when transactions are added, removed or prioritised.
  */
 class CTxMemPoolEntry
 {
@@ -33,6 +42,16 @@ private:
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount feeDelta;     //! Fee delta set by PrioritiseTransaction
+    size_t nUsageSize;    //! Heap memory used by the transaction
+
+    uint64_t nCountWithAncestors;  //! Number of in-mempool ancestors, this entry included
+    uint64_t nSizeWithAncestors;   //! ... and their total size
+    CAmount nModFeesWithAncestors; //! ... and their total modified fees
+
+    uint64_t nCountWithDescendants;  //! Number of in-mempool descendants, this entry included
+    uint64_t nSizeWithDescendants;   //! ... and their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -45,8 +64,183 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    CAmount GetModifiedFee() const { return nFee + feeDelta; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    //! Replace the fee delta, adjusting the package fees by the difference
+    void UpdateFeeDelta(CAmount newFeeDelta);
+    //! Adjust the ancestor totals when an ancestor changes
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Set the ancestor totals from a full ancestor walk
+    void SetAncestorState(uint64_t nSize, CAmount nModFees, uint64_t nCount);
+    //! Adjust the descendant totals when a descendant changes
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Set the descendant totals from a full descendant walk
+    void SetDescendantState(uint64_t nSize, CAmount nModFees, uint64_t nCount);
+};
+
+/** Modifiers for entries in CTxMemPool::mapTx, which are only changed through multi_index modify() */
+struct update_fee_delta {
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+struct update_ancestor_state {
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) : modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct set_ancestor_state {
+    set_ancestor_state(uint64_t _nSize, CAmount _nModFees, uint64_t _nCount) : nSize(_nSize), nModFees(_nModFees), nCount(_nCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.SetAncestorState(nSize, nModFees, nCount); }
+
+private:
+    uint64_t nSize;
+    CAmount nModFees;
+    uint64_t nCount;
+};
+
+struct update_descendant_state {
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) : modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct set_descendant_state {
+    set_descendant_state(uint64_t _nSize, CAmount _nModFees, uint64_t _nCount) : nSize(_nSize), nModFees(_nModFees), nCount(_nCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.SetDescendantState(nSize, nModFees, nCount); }
+
+private:
+    uint64_t nSize;
+    CAmount nModFees;
+    uint64_t nCount;
+};
+
+/** Extract the transaction id from a mempool entry, the primary key of CTxMemPool::mapTx */
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Order entries by their own modified fee rate, highest first, then by txid */
+class CompareTxMemPoolEntryByFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/**
+ * Order entries by the lower of their own modified fee rate and the fee
+ * rate of their ancestor package, highest first, then by txid. A
+ * transaction can then not be pulled ahead by a cheap parent, nor a
+ * cheap parent by a generous child.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees, aSize, bFees, bSize;
+        GetScore(a, aFees, aSize);
+        GetScore(b, bFees, bSize);
+        double f1 = aFees * bSize;
+        double f2 = bFees * aSize;
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+
+    static void GetScore(const CTxMemPoolEntry& e, double& fees, double& size)
+    {
+        // The package fee rate is the lower one if fees_a / size_a > fees_p / size_p
+        if ((double)e.GetModFeesWithAncestors() * e.GetTxSize() < (double)e.GetModifiedFee() * e.GetSizeWithAncestors()) {
+            fees = e.GetModFeesWithAncestors();
+            size = e.GetSizeWithAncestors();
+        } else {
+            fees = e.GetModifiedFee();
+            size = e.GetTxSize();
+        }
+    }
+};
+
+/**
+ * Order entries by the higher of their own modified fee rate and the fee
+ * rate of their descendant package, lowest first, then by txid. Eviction
+ * takes the first entry with its descendants, so a transaction is not
+ * evicted for the sake of a cheap child.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees, aSize, bFees, bSize;
+        GetScore(a, aFees, aSize);
+        GetScore(b, bFees, bSize);
+        double f1 = aFees * bSize;
+        double f2 = bFees * aSize;
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 < f2;
+    }
+
+    static void GetScore(const CTxMemPoolEntry& e, double& fees, double& size)
+    {
+        if ((double)e.GetModFeesWithDescendants() * e.GetTxSize() > (double)e.GetModifiedFee() * e.GetSizeWithDescendants()) {
+            fees = e.GetModFeesWithDescendants();
+            size = e.GetSizeWithDescendants();
+        } else {
+            fees = e.GetModifiedFee();
+            size = e.GetTxSize();
+        }
+    }
+};
+
+/** Order entries by the time they entered the mempool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
 };
 
+// Tags for the secondary indexes of CTxMemPool::mapTx
+struct fee_rate {};
+struct ancestor_score {};
+struct descendant_score {};
+struct entry_time {};
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -89,13 +283,82 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the entries and their links
+
+    //! Minimum fee rate after evictions, decaying over time once blocks come in
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate;
+
+    uint64_t nEvicted; //! Transactions removed by TrimToSize
+    uint64_t nExpired; //! Transactions removed by Expire
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by own modified fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<fee_rate>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByFee>,
+            // sorted by ancestor package score, for block assembly
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee>,
+            // sorted by descendant package score, for eviction
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore>,
+            // sorted by entry time, for expiry
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime> > >
+        indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::const_iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    /** Time for the rolling minimum fee to halve once blocks come in */
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    /** In-mempool parents and children of each entry */
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    //! Recompute the ancestor totals of an entry from its ancestor set
+    void UpdateAncestorState(txiter it);
+    //! Recompute the descendant totals of an entry from its descendant set
+    void UpdateDescendantState(txiter it);
+    //! Erase an entry whose links to other entries are already detached
+    void removeUnchecked(txiter it);
+
+public:
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -125,6 +388,45 @@ public:
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * Collect the in-mempool ancestors of an entry, not including the entry.
+     * With fSearchForParents the parents are looked up from the inputs, so
+     * the entry need not be in the pool yet; otherwise the stored links are used.
+     */
+    void CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, bool fSearchForParents = true) const;
+    /**
+     * As above, but stop and return false with errString set once the entry with its ancestors
+     * goes over limitAncestorCount or limitAncestorSize, or an ancestor would get more than
+     * limitDescendantCount or limitDescendantSize worth of descendants. Mempool acceptance
+     * enforces these limits, which bound the walks that keep the cached package state.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const;
+    /** Collect an entry and all its in-mempool descendants into setDescendants */
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+
+    /**
+     * Evict the lowest scoring descendant packages until the pool uses no more
+     * than sizelimit bytes, and raise the minimum fee above what was evicted.
+     */
+    void TrimToSize(size_t sizelimit);
+
+    /** Remove the transactions that entered the pool before time, with their descendants. Returns the number removed. */
+    int Expire(int64_t time);
+
+    /**
+     * The minimum fee rate to get into a pool of sizelimit bytes: zero until
+     * something is evicted, then the rolling fee, which halves every
+     * ROLLING_FEE_HALFLIFE (faster while the pool is less than half full)
+     * once a block has come in since the last eviction.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /** Estimate of the heap memory used by the pool */
+    size_t DynamicMemoryUsage() const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -135,6 +437,16 @@ public:
         LOCK(cs);
         return totalTxSize;
     }
+    uint64_t GetEvictedCount()
+    {
+        LOCK(cs);
+        return nEvicted;
+    }
+    uint64_t GetExpiredCount()
+    {
+        LOCK(cs);
+        return nExpired;
+    }
 
     bool exists(uint256 hash)
     {
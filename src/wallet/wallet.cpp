@@ -835,6 +835,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         wtx.BindWallet(this);
         wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        MarkStakeDirty(wtx);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -890,6 +891,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkStakeDirty(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -975,6 +977,7 @@ void CWallet::EraseFromWallet(const uint256& hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        setStakeDirty.insert(hash);
     }
     return;
 }
@@ -1770,28 +1773,108 @@ static void ApproximateBestSubset(std::vector<std::pair<CAmount, std::pair<const
     }
 }
 
+void CWallet::MarkStakeDirty(const CTransaction& tx)
+{
+    // The transaction's own outputs and the ones it spends may have changed status
+    setStakeDirty.insert(tx.GetHash());
+    for (const CTxIn& txin : tx.vin)
+        setStakeDirty.insert(txin.prevout.hash);
+}
+
+void CWallet::UpdateStakeCandidates()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fStakeCandidatesLoaded) {
+        mapStakeCandidates.clear();
+        for (const PAIRTYPE(const uint256, CWalletTx) & item : mapWallet)
+            setStakeDirty.insert(item.first);
+        fStakeCandidatesLoaded = true;
+    }
+
+    // After a reorg the cached v1 modifiers may come from disconnected blocks,
+    // and so may the blocks some candidates were confirmed in
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexStakeCandidates && pindexTip && pindexTip->GetAncestor(pindexStakeCandidates->nHeight) != pindexStakeCandidates) {
+        for (PAIRTYPE(const COutPoint, CStakeCandidate) & item : mapStakeCandidates) {
+            item.second.fStakeModifier = false;
+            if (!chainActive.Contains(item.second.pindexFrom))
+                setStakeDirty.insert(item.first.hash);
+        }
+    }
+    pindexStakeCandidates = pindexTip;
+
+    for (const uint256& hash : setStakeDirty) {
+        std::map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.lower_bound(COutPoint(hash, 0));
+        while (it != mapStakeCandidates.end() && it->first.hash == hash)
+            mapStakeCandidates.erase(it++);
+
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = mi->second;
+
+        // Only outputs confirmed in the active chain can stake
+        BlockMap::iterator bi = mapBlockIndex.find(wtx.hashBlock);
+        if (bi == mapBlockIndex.end() || !chainActive.Contains(bi->second))
+            continue;
+
+        CStakeCandidate candidate;
+        candidate.pindexFrom = bi->second;
+        if (wtx.IsCoinBase() || wtx.IsCoinStake())
+            candidate.nMaturityHeight = candidate.pindexFrom->nHeight + Params().COINBASE_MATURITY();
+
+        // Spent and locked state is checked every round, it can flip without a wallet event
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            if (wtx.vout[i].nValue <= 0 || IsMine(wtx.vout[i]) == ISMINE_NO)
+                continue;
+            mapStakeCandidates.insert(std::make_pair(COutPoint(hash, i), candidate));
+        }
+    }
+    setStakeDirty.clear();
+}
+
 bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount,
         int blockHeight)
 {
-    LOCK(cs_main);
-    std::vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+    LOCK2(cs_main, cs_wallet);
+    UpdateStakeCandidates();
+
+    const bool fModifierV1 = !Params().IsStakeModifierV2(blockHeight);
+    const int nChainHeight = chainActive.Height();
+    const int64_t nTime = GetAdjustedTime();
     CAmount nAmountSelected = 0;
-    for (const COutput &out : vCoins) {
+    for (PAIRTYPE(const COutPoint, CStakeCandidate) & item : mapStakeCandidates) {
+        const COutPoint& out = item.first;
+        CStakeCandidate& candidate = item.second;
+        if (nChainHeight < candidate.nMaturityHeight)
+            continue;
+        if (IsSpent(out.hash, out.n) || IsLockedCoin(out.hash, out.n))
+            continue;
+
+        const CWalletTx& wtx = mapWallet.at(out.hash);
         //make sure not to outrun target amount
-        if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+        if (nAmountSelected + wtx.vout[out.n].nValue > nTargetAmount)
             continue;
 
-        CBlockIndex* utxoBlock = mapBlockIndex.at(out.tx->hashBlock);
         //check for maturity (min age/depth)
-        if (!Params().HasStakeMinAgeOrDepth(blockHeight, GetAdjustedTime(), utxoBlock->nHeight, utxoBlock->GetBlockTime()))
+        if (!Params().HasStakeMinAgeOrDepth(blockHeight, nTime, candidate.pindexFrom->nHeight, candidate.pindexFrom->GetBlockTime()))
             continue;
 
         //add to our stake set
-        nAmountSelected += out.tx->vout[out.i].nValue;
+        nAmountSelected += wtx.vout[out.n].nValue;
 
         std::unique_ptr<CNbxStake> input(new CNbxStake());
-        input->SetInput((CTransaction) *out.tx, out.i);
+        input->SetInput((CTransaction) wtx, out.n);
+        input->SetIndexFrom(candidate.pindexFrom);
+        if (fModifierV1) {
+            if (!candidate.fStakeModifier)
+                candidate.fStakeModifier = GetKernelStakeModifier(candidate.pindexFrom->GetBlockHash(), candidate.nStakeModifier,
+                    candidate.nStakeModifierHeight, candidate.nStakeModifierTime, false);
+            if (candidate.fStakeModifier)
+                input->SetModifier(candidate.nStakeModifier, candidate.nStakeModifierHeight, candidate.nStakeModifierTime);
+        }
         listInputs.emplace_back(std::move(input));
     }
     return true;
@@ -1799,7 +1882,7 @@ bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInp
 
 bool CWallet::MintableCoins()
 {
-    LOCK(cs_main);
+    LOCK2(cs_main, cs_wallet);
     CAmount nBalance = GetBalance();
 
     if (nBalance > 0) {
@@ -1808,15 +1891,18 @@ bool CWallet::MintableCoins()
         if (nBalance <= nReserveBalance)
             return false;
 
-        std::vector<COutput> vCoins;
-        AvailableCoins(vCoins, true);
+        UpdateStakeCandidates();
 
         int chainHeight = chainActive.Height();
         int64_t time = GetAdjustedTime();
-        for (const COutput& out : vCoins) {
-            CBlockIndex* utxoBlock = mapBlockIndex.at(out.tx->hashBlock);
+        for (const PAIRTYPE(const COutPoint, CStakeCandidate) & item : mapStakeCandidates) {
+            const CStakeCandidate& candidate = item.second;
+            if (chainHeight < candidate.nMaturityHeight)
+                continue;
+            if (IsSpent(item.first.hash, item.first.n) || IsLockedCoin(item.first.hash, item.first.n))
+                continue;
             //check for maturity (min age/depth)
-            if (Params().HasStakeMinAgeOrDepth(chainHeight, time, utxoBlock->nHeight, utxoBlock->nTime))
+            if (Params().HasStakeMinAgeOrDepth(chainHeight, time, candidate.pindexFrom->nHeight, candidate.pindexFrom->nTime))
                 return true;
         }
     }
@@ -2229,7 +2315,6 @@ bool CWallet::CreateCoinStake(
     CAmount nCredit;
     CScript scriptPubKeyKernel;
     bool fKernelFound = false;
-    int nAttempts = 0;
 
     // Block time.
     nTxNewTime = GetAdjustedTime();
@@ -2238,67 +2323,80 @@ bool CWallet::CreateCoinStake(
         nTxNewTime = pindexPrev->nTime;
     }
 
+    // Hash the time-independent part of every kernel once, then sweep them all together
+    std::vector<CStakeKernel> vKernels;
+    vKernels.reserve(listInputs.size());
     for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
+        CStakeKernel kernel;
+        if (kernel.SetInput(pindexPrev, stakeInput.get(), nBits, nTxNewTime))
+            vKernels.push_back(kernel);
+    }
+
+    size_t nStart = 0;
+    while (nStart < vKernels.size()) {
         nCredit = 0;
         // Make sure the wallet is unlocked and shutdown hasn't been requested
         if (IsLocked() || ShutdownRequested())
             return false;
 
-        uint256 hashProofOfStake = 0;
-        nAttempts++;
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (Stake(pindexPrev, stakeInput.get(), nBits, nTxNewTime, hashProofOfStake)) {
+        int nKernel = FindStakeKernel(pindexPrev, vKernels, nStart, nTxNewTime);
+        if (nKernel < 0)
+            break;
+        // On failure below resume the search after this input
+        nStart = nKernel + 1;
 
-            // Found a kernel
-            LogPrintf("CreateCoinStake : kernel found\n");
-            nCredit += stakeInput->GetValue();
+        CStakeInput* stakeInput = vKernels[nKernel].stakeInput;
 
-            // Calculate reward
-            CAmount nReward;
-            nReward = GetBlockValue(chainActive.Height() + 1, prevMoneySupply);
-            nCredit += nReward;
+        // Found a kernel
+        LogPrintf("CreateCoinStake : kernel found\n");
+        nCredit += stakeInput->GetValue();
 
-            // Create the output transaction(s)
-            std::vector<CTxOut> vout;
-            if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
-                LogPrintf("%s : failed to get scriptPubKey\n", __func__);
-                continue;
-            }
-            txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
+        // Calculate reward
+        CAmount nReward;
+        nReward = GetBlockValue(chainActive.Height() + 1, prevMoneySupply);
+        nCredit += nReward;
 
-            CAmount nMinFee = 0;
-            // Set output amount
-            if (txNew.vout.size() == 3) {
-                txNew.vout[1].nValue = (nCredit - nMinFee) / 2;
-                txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
-            } else
-                txNew.vout[1].nValue = nCredit - nMinFee;
+        // Create the output transaction(s)
+        std::vector<CTxOut> vout;
+        if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
+            LogPrintf("%s : failed to get scriptPubKey\n", __func__);
+            continue;
+        }
+        txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
 
-            // Limit size
-            unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
-                return error("CreateCoinStake : exceeded coinstake size limit");
+        CAmount nMinFee = 0;
+        // Set output amount
+        if (txNew.vout.size() == 3) {
+            txNew.vout[1].nValue = (nCredit - nMinFee) / 2;
+            txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
+        } else
+            txNew.vout[1].nValue = nCredit - nMinFee;
 
-            //Masternode payment
-            if (!FillBlockPayee(txNew, nMinFee, true)) {
-                return error("CreateCoinStake : error filling block payments");
-            }
+        // Limit size
+        unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
+            return error("CreateCoinStake : exceeded coinstake size limit");
 
-            uint256 hashTxOut = txNew.GetHash();
-            CTxIn in;
-            if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
-                LogPrintf("%s : failed to create TxIn\n", __func__);
-                txNew.vin.clear();
-                txNew.vout.clear();
-                continue;
-            }
-            txNew.vin.emplace_back(in);
+        //Masternode payment
+        if (!FillBlockPayee(txNew, nMinFee, true)) {
+            return error("CreateCoinStake : error filling block payments");
+        }
 
-            fKernelFound = true;
-            break;
+        uint256 hashTxOut = txNew.GetHash();
+        CTxIn in;
+        if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
+            LogPrintf("%s : failed to create TxIn\n", __func__);
+            txNew.vin.clear();
+            txNew.vout.clear();
+            continue;
         }
+        txNew.vin.emplace_back(in);
+
+        nTxNewTime = vKernels[nKernel].nTimeTx;
+        fKernelFound = true;
+        break;
     }
-    LogPrint("staking", "%s: attempted staking %d times\n", __func__, nAttempts);
+    LogPrint("staking", "%s: searched %u stake inputs\n", __func__, vKernels.size());
 
     if (!fKernelFound)
         return false;
@@ -92,6 +92,30 @@ struct CompactTallyItem {
     }
 };
 
+/**
+ * A wallet output that may be staked, with the chain lookups CNbxStake would
+ * otherwise redo every minting round.
+ */
+struct CStakeCandidate {
+    CBlockIndex* pindexFrom;
+    //! height at which a coinbase/coinstake output matures, 0 otherwise
+    int nMaturityHeight;
+    //! v1 kernel stake modifier, valid when fStakeModifier is set
+    bool fStakeModifier;
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    CStakeCandidate()
+    {
+        pindexFrom = NULL;
+        nMaturityHeight = 0;
+        fStakeModifier = false;
+        nStakeModifier = 0;
+        nStakeModifierHeight = 0;
+        nStakeModifierTime = 0;
+    }
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -168,6 +192,17 @@ private:
 
     void GetChainChildKey(const CKeyID &address, CExtKey &chainChildKey, CKeyID *masterKeyId = NULL) EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
 
+    /**
+     * Stake candidates, kept up to date from wallet transaction events so a
+     * minting round only re-examines the transactions that changed.
+     */
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    std::set<uint256> setStakeDirty;
+    bool fStakeCandidatesLoaded;
+    const CBlockIndex* pindexStakeCandidates;
+    void MarkStakeDirty(const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
+    void UpdateStakeCandidates() EXCLUSIVE_LOCKS_REQUIRED(cs_main, cs_wallet);
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount, int blockHeight);
@@ -249,6 +284,8 @@ public:
         nTimeFirstKey = 0;
         fWalletUnlockStakingOnly = false;
         fBackupMints = false;
+        fStakeCandidatesLoaded = false;
+        pindexStakeCandidates = NULL;
 
         // Stake Settings
         nHashDrift = 45;
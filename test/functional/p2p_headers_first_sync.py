@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018-2021 Netbox.Global
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test headers-first block download from several peers.
+
+- Node 0 mines past the last PoW block, nodes 1 and 2 sync from node 0.
+- Node 3 starts empty and connects to nodes 0, 1 and 2.
+- Node 3 syncs the headers, then downloads the blocks from more than one
+  peer, storing proof-of-stake blocks ahead of their parents' data.
+"""
+
+import os
+import re
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, assert_greater_than, connect_nodes, sync_blocks
+
+MINED_BLOCKS = 500
+
+class HeadersFirstSyncTest(BitcoinTestFramework):
+
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 4
+
+    def setup_network(self):
+        self.setup_nodes()
+        connect_nodes(self.nodes[1], 0)
+        connect_nodes(self.nodes[2], 0)
+
+    def blocks_received_by_peer(self, node):
+        peers = {}
+        with open(os.path.join(node.datadir, "regtest", "debug.log"), encoding="utf-8") as f:
+            for line in f:
+                m = re.search(r"received block \w+ peer=(\d+)", line)
+                if m:
+                    peers[m.group(1)] = peers.get(m.group(1), 0) + 1
+        return peers
+
+    def run_test(self):
+        self.log.info("Mining %d blocks on node 0" % MINED_BLOCKS)
+        self.nodes[0].generate(MINED_BLOCKS)
+        sync_blocks(self.nodes[0:3])
+
+        self.log.info("Syncing node 3 from nodes 0, 1 and 2")
+        for i in range(3):
+            connect_nodes(self.nodes[3], i)
+        sync_blocks(self.nodes, timeout=120)
+        assert_equal(self.nodes[3].getblockcount(), MINED_BLOCKS)
+        assert_equal(self.nodes[3].getbestblockhash(), self.nodes[0].getbestblockhash())
+
+        peers = self.blocks_received_by_peer(self.nodes[3])
+        self.log.info("Blocks received per peer: %s" % peers)
+        assert_greater_than(len(peers), 1)
+        assert_greater_than(MINED_BLOCKS, max(peers.values()))
+
+if __name__ == '__main__':
+    HeadersFirstSyncTest().main()
@@ -69,9 +69,16 @@ class BlockchainTest(BitcoinTestFramework):
         assert_equal(res['transactions'], 200)
         assert_equal(res['height'], 200)
         assert_equal(res['txouts'], 200)
-        assert_equal(res['bytes_serialized'], 14073),
+        assert_equal(res['bytes_serialized'], 14369),
         assert_equal(len(res['bestblock']), 64)
-        assert_equal(len(res['hash_serialized']), 64)
+        assert_equal(len(res['muhash']), 64)
+        assert 'hash_serialized' not in res
+
+        # A full scan finds the same statistics as the running ones
+        res_scan = node.gettxoutsetinfo(True)
+        assert_equal(len(res_scan['hash_serialized']), 64)
+        del res_scan['hash_serialized']
+        assert_equal(res_scan, res)
 
     def _test_getblockheader(self):
         node = self.nodes[0]
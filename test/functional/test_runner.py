@@ -82,9 +82,10 @@ BASE_SCRIPTS= [
 
     # vv Tests less than 60s vv
     #'wallet_importmulti.py',
-    #'mempool_limit.py', # We currently don't limit our mempool
+    #'mempool_limit.py', # Needs fundrawtransaction
     #'wallet_abandonconflict.py',
     'feature_reindex.py',
+    'p2p_headers_first_sync.py',
 
     # vv Tests less than 30s vv
     'rpc_spork.py',